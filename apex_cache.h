@@ -0,0 +1,153 @@
+/* Keeps the spectra of recently used apex kernels around, so that switching
+ * back and forth between apex radii or apex options (joystick hat, +/- keys)
+ * doesn't need to recalculate the kernel and its FFT every time.
+ * Entries are evicted least recently used first, keeping the total size of
+ * all spectra below a byte limit. At least one entry is always kept.
+ *
+ * An entry holds either a full complex spectrum, or, for kernels that are
+ * even about the origin, only its real part (the imaginary part of an even
+ * kernel's spectrum is zero), which takes half the bytes. */
+
+typedef struct {
+  double apex_r;
+  char apex_opt;
+  int W;
+  int H;
+  /* FFTW(complex)[H * (W/2+1)], or pixel_t[H * (W/2+1)] if real. */
+  void *spectrum;
+  bool real;
+  /* the kernel is even along x and along y on its own (see dct.h). */
+  bool axes_even;
+  /* nonzero taps of the kernel for direct convolution, or NULL if it is too
+   * large (see stencil.h). */
+  stencil_tap_t *taps;
+  int n_taps;
+  int taps_r;
+  size_t bytes;
+  unsigned int last_used;
+} apex_cache_entry_t;
+
+typedef struct {
+  apex_cache_entry_t *entries;
+  int n;
+  int max_n;
+  size_t max_bytes;
+  size_t bytes;
+  size_t complex_bytes;
+  unsigned int tick;
+  int hits;
+  int misses;
+} apex_cache_t;
+
+/* complex_bytes is the size of one full complex spectrum. */
+void apex_cache_init(apex_cache_t *c, size_t max_bytes, size_t complex_bytes) {
+  bzero(c, sizeof(*c));
+  c->max_bytes = max_bytes;
+  c->complex_bytes = complex_bytes;
+  // real entries are half the size, so up to twice as many fit.
+  c->max_n = max(1, 2 * (max_bytes / complex_bytes));
+  c->entries = malloc_check(c->max_n * sizeof(apex_cache_entry_t));
+}
+
+void apex_cache_destroy(apex_cache_t *c) {
+  int i;
+  for (i = 0; i < c->n; i++) {
+    FFTW(free)(c->entries[i].spectrum);
+    free(c->entries[i].taps);
+  }
+  free(c->entries);
+  bzero(c, sizeof(*c));
+}
+
+static void apex_cache_evict_lru(apex_cache_t *c) {
+  int i;
+  apex_cache_entry_t *lru = NULL;
+  for (i = 0; i < c->n; i++) {
+    apex_cache_entry_t *e = &c->entries[i];
+    if ((! lru) || ((c->tick - e->last_used) > (c->tick - lru->last_used)))
+      lru = e;
+  }
+  if (! lru)
+    return;
+  FFTW(free)(lru->spectrum);
+  free(lru->taps);
+  c->bytes -= lru->bytes;
+  c->n --;
+  // keep the array dense.
+  *lru = c->entries[c->n];
+}
+
+static void *apex_cache_alloc(apex_cache_t *c, size_t bytes) {
+  void *p = FFTW(malloc)(bytes);
+  if (! p) {
+    printf("No mem.\n");
+    exit(-1);
+  }
+  return p;
+}
+
+/* Return the entry for the given kernel parameters, or NULL if there is none,
+ * in which case the caller should apex_cache_add() it. */
+apex_cache_entry_t *apex_cache_find(apex_cache_t *c, double apex_r,
+                                    char apex_opt, int W, int H) {
+  int i;
+
+  c->tick ++;
+
+  for (i = 0; i < c->n; i++) {
+    apex_cache_entry_t *e = &c->entries[i];
+    if ((e->apex_r == apex_r) && (e->apex_opt == apex_opt)
+        && (e->W == W) && (e->H == H)) {
+      e->last_used = c->tick;
+      c->hits ++;
+      return e;
+    }
+  }
+  c->misses ++;
+  return NULL;
+}
+
+/* Make room for and register a new entry with a full complex spectrum buffer,
+ * to be filled by the caller. The returned pointer is valid until the next
+ * apex_cache_add(). */
+apex_cache_entry_t *apex_cache_add(apex_cache_t *c, double apex_r,
+                                   char apex_opt, int W, int H) {
+  while ((c->n >= c->max_n)
+         || (c->n && ((c->bytes + c->complex_bytes) > c->max_bytes)))
+    apex_cache_evict_lru(c);
+
+  apex_cache_entry_t *e = &c->entries[c->n ++];
+  e->apex_r = apex_r;
+  e->apex_opt = apex_opt;
+  e->W = W;
+  e->H = H;
+  e->real = false;
+  e->axes_even = false;
+  e->taps = NULL;
+  e->n_taps = 0;
+  e->taps_r = 0;
+  e->bytes = c->complex_bytes;
+  e->spectrum = apex_cache_alloc(c, e->bytes);
+  e->last_used = c->tick;
+  c->bytes += e->bytes;
+  return e;
+}
+
+/* Replace the complex spectrum of an entry by its real part, for a kernel
+ * that is even about the origin. */
+void apex_cache_make_real(apex_cache_t *c, apex_cache_entry_t *e) {
+  int i;
+  int n = c->complex_bytes / sizeof(FFTW(complex));
+  FFTW(complex) *f = e->spectrum;
+  pixel_t *re = apex_cache_alloc(c, n * sizeof(pixel_t));
+
+  for (i = 0; i < n; i++)
+    re[i] = f[i][0];
+
+  FFTW(free)(f);
+  c->bytes -= e->bytes;
+  e->spectrum = re;
+  e->real = true;
+  e->bytes = n * sizeof(pixel_t);
+  c->bytes += e->bytes;
+}
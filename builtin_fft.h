@@ -0,0 +1,477 @@
+/* A self-contained FFT backend (-X builtin, see fft_backend.h), for sizes
+ * whose only prime factors are 2, 3, 5 and 7, like those -G picks.
+ *
+ * The complex FFTs are mixed radix Stockham FFTs: each pass does the
+ * butterflies of one radix, 4 and 2 first, then 3, 5 and 7, reading one
+ * buffer and writing the other in sorted order, so there is no bit reversal
+ * pass. The real rows of even width W are transformed as W/2 complex points,
+ * even pixels as real and odd ones as imaginary part, and split into the
+ * W/2+1 spectrum bins afterwards. Odd widths take a complex FFT of W points.
+ *
+ * The columns of the spectrum are done in blocks of BUILTIN_LANES columns:
+ * a block is copied into a scratch buffer, with the columns side by side,
+ * transformed at once so that the innermost loops run over adjacent columns,
+ * and copied back. Rows and column blocks are spread across a pool of worker
+ * threads of its own, sized like FFTW's (-t). Each thread has its scratch in
+ * the plan. Plans made while the pool has a single thread (threads(1)) run
+ * on the calling thread alone, and can be executed by several threads at
+ * once, each with a plan of its own, like the tiled engine does.
+ *
+ * A plan may cover n canvases one after the other (plan_many), whose rows
+ * are then done like the rows of one canvas n times as high. */
+
+#define BUILTIN_MAX_PASSES 32
+#define BUILTIN_LANES 8
+
+typedef struct {
+  int n;
+  int n_passes;
+  int radix[BUILTIN_MAX_PASSES];
+  /* per pass, the r x r DFT matrix w_r^(j*k), followed by the twiddles
+   * w_(r*m)^(j*p) for p < m, j < r, where r*m is the length left to do;
+   * complex. w is e^(-2 pi i / n) forward and e^(2 pi i / n) inverse. */
+  pixel_t *tw[BUILTIN_MAX_PASSES];
+} builtin_cfft_t;
+
+typedef struct {
+  int n;
+  int W;
+  int H;
+  int half_W;
+  /* row stride of the real buffer in pixel_t: W, or 2 * half_W in place. */
+  int real_pitch;
+  builtin_cfft_t rows;
+  builtin_cfft_t cols;
+  /* e^(-2 pi i k / W) for k <= W/2, to split even width rows. */
+  pixel_t *split;
+  /* run on the calling thread, not on builtin_workers. */
+  bool serial;
+  /* n_scratch slots of scratch_len pixel_t, one per worker thread, for two
+   * complex buffers of a row or a column block each. */
+  pixel_t *scratch;
+  int n_scratch;
+  size_t scratch_len;
+
+  /* the current transform */
+  pixel_t *real;
+  pixel_t *cplx;
+} builtin_plan_t;
+
+workers_t builtin_workers;
+
+static bool builtin_cfft_init(builtin_cfft_t *c, int n, int sign) {
+  int i, j, k, p;
+  int left = n;
+
+  bzero(c, sizeof(*c));
+  c->n = n;
+  while (left > 1) {
+    int r = ((left % 4) == 0)? 4
+            : ((left % 2) == 0)? 2
+            : ((left % 3) == 0)? 3
+            : ((left % 5) == 0)? 5
+            : ((left % 7) == 0)? 7 : 0;
+    if ((! r) || (c->n_passes == BUILTIN_MAX_PASSES))
+      return false;
+
+    int m = left / r;
+    pixel_t *tw = malloc_check(2 * (r * r + r * m) * sizeof(pixel_t));
+    for (j = 0; j < r; j++) {
+      for (k = 0; k < r; k++) {
+        double a = sign * 2 * M_PI * ((j * k) % r) / r;
+        tw[2 * (j * r + k)] = cos(a);
+        tw[2 * (j * r + k) + 1] = sin(a);
+      }
+    }
+    pixel_t *t = tw + 2 * r * r;
+    for (p = 0; p < m; p++) {
+      for (j = 0; j < r; j++) {
+        double a = sign * 2 * M_PI * (double)j * p / left;
+        t[2 * (p * r + j)] = cos(a);
+        t[2 * (p * r + j) + 1] = sin(a);
+      }
+    }
+    i = c->n_passes ++;
+    c->radix[i] = r;
+    c->tw[i] = tw;
+    left = m;
+  }
+  return true;
+}
+
+static void builtin_cfft_destroy(builtin_cfft_t *c) {
+  int i;
+  for (i = 0; i < c->n_passes; i++)
+    free(c->tw[i]);
+  bzero(c, sizeof(*c));
+}
+
+/* One pass of radix r over L lanes: the inputs of a butterfly are xs apart,
+ * its outputs os apart. a_k = in[k * xs], A_j = sum_k a_k w_r^(jk) times
+ * twiddle j, out[j * os] = A_j. */
+static void builtin_butterflies(int r, const pixel_t *dft, const pixel_t *w,
+                                const pixel_t *in, int xs, pixel_t *out,
+                                int os, int L) {
+  int j, k, l;
+
+  if (r == 2) {
+    for (l = 0; l < 2 * L; l += 2) {
+      pixel_t a0r = in[l], a0i = in[l + 1];
+      pixel_t a1r = in[xs + l], a1i = in[xs + l + 1];
+      pixel_t dr = a0r - a1r, di = a0i - a1i;
+      out[l] = a0r + a1r;
+      out[l + 1] = a0i + a1i;
+      out[os + l] = dr * w[2] - di * w[3];
+      out[os + l + 1] = dr * w[3] + di * w[2];
+    }
+    return;
+  }
+
+  if (r == 4) {
+    // dft[2 * 5] is w_4^1: -i forward, i inverse.
+    pixel_t w4 = dft[11];
+    for (l = 0; l < 2 * L; l += 2) {
+      pixel_t t0r = in[l] + in[2 * xs + l];
+      pixel_t t0i = in[l + 1] + in[2 * xs + l + 1];
+      pixel_t t1r = in[l] - in[2 * xs + l];
+      pixel_t t1i = in[l + 1] - in[2 * xs + l + 1];
+      pixel_t t2r = in[xs + l] + in[3 * xs + l];
+      pixel_t t2i = in[xs + l + 1] + in[3 * xs + l + 1];
+      // (a1 - a3) * w_4
+      pixel_t t3r = -w4 * (in[xs + l + 1] - in[3 * xs + l + 1]);
+      pixel_t t3i = w4 * (in[xs + l] - in[3 * xs + l]);
+      pixel_t a1r = t1r + t3r, a1i = t1i + t3i;
+      pixel_t a2r = t0r - t2r, a2i = t0i - t2i;
+      pixel_t a3r = t1r - t3r, a3i = t1i - t3i;
+      out[l] = t0r + t2r;
+      out[l + 1] = t0i + t2i;
+      out[os + l] = a1r * w[2] - a1i * w[3];
+      out[os + l + 1] = a1r * w[3] + a1i * w[2];
+      out[2 * os + l] = a2r * w[4] - a2i * w[5];
+      out[2 * os + l + 1] = a2r * w[5] + a2i * w[4];
+      out[3 * os + l] = a3r * w[6] - a3i * w[7];
+      out[3 * os + l + 1] = a3r * w[7] + a3i * w[6];
+    }
+    return;
+  }
+
+  for (j = 0; j < r; j++) {
+    pixel_t acc[2 * BUILTIN_LANES];
+    bzero(acc, 2 * L * sizeof(pixel_t));
+    for (k = 0; k < r; k++) {
+      const pixel_t *a = in + k * xs;
+      pixel_t dr = dft[2 * (j * r + k)];
+      pixel_t di = dft[2 * (j * r + k) + 1];
+      for (l = 0; l < 2 * L; l += 2) {
+        acc[l] += a[l] * dr - a[l + 1] * di;
+        acc[l + 1] += a[l] * di + a[l + 1] * dr;
+      }
+    }
+    pixel_t wr = w[2 * j];
+    pixel_t wi = w[2 * j + 1];
+    for (l = 0; l < 2 * L; l += 2) {
+      out[j * os + l] = acc[l] * wr - acc[l + 1] * wi;
+      out[j * os + l + 1] = acc[l] * wi + acc[l + 1] * wr;
+    }
+  }
+}
+
+/* Transform the c->n points of L interleaved lanes at x, i.e. point i of
+ * lane l is the complex number at x + 2 * (i * L + l). y is scratch of the
+ * same size. Returns x or y, whichever holds the result. */
+static pixel_t *builtin_cfft(const builtin_cfft_t *c, pixel_t *x, pixel_t *y,
+                             int L) {
+  int i, p, q;
+  int stride = 1;
+  int left = c->n;
+
+  for (i = 0; i < c->n_passes; i++) {
+    int r = c->radix[i];
+    int m = left / r;
+    const pixel_t *dft = c->tw[i];
+    const pixel_t *tw = dft + 2 * r * r;
+    for (p = 0; p < m; p++) {
+      for (q = 0; q < stride; q++) {
+        builtin_butterflies(r, dft, tw + 2 * r * p,
+                            x + 2 * L * (q + stride * p), 2 * L * stride * m,
+                            y + 2 * L * (q + stride * r * p), 2 * L * stride, L);
+      }
+    }
+    pixel_t *swap = x;
+    x = y;
+    y = swap;
+    stride *= r;
+    left = m;
+  }
+  return x;
+}
+
+static bool builtin_fits(int W, int H) {
+  builtin_cfft_t rows = {0}, cols = {0};
+  bool fits = builtin_cfft_init(&rows, (W & 1)? W : W / 2, -1)
+              && builtin_cfft_init(&cols, H, -1);
+  builtin_cfft_destroy(&rows);
+  builtin_cfft_destroy(&cols);
+  return fits;
+}
+
+static void builtin_threads(int n) {
+  if (builtin_workers.n != max(1, n)) {
+    if (builtin_workers.n)
+      workers_destroy(&builtin_workers);
+    workers_init(&builtin_workers, n);
+  }
+}
+
+static void builtin_cleanup(void) {
+  if (builtin_workers.n)
+    workers_destroy(&builtin_workers);
+}
+
+static void *builtin_malloc(size_t bytes) {
+  void *p;
+  if (posix_memalign(&p, 64, bytes))
+    return NULL;
+  return p;
+}
+
+static void builtin_free(void *p) {
+  free(p);
+}
+
+/* Scratch for each thread of the pool, again if it grew since planning. */
+static void builtin_plan_scratch(builtin_plan_t *b) {
+  int n = b->serial? 1 : max(1, builtin_workers.n);
+  if (b->n_scratch >= n)
+    return;
+  free(b->scratch);
+  b->scratch = builtin_malloc(n * b->scratch_len * sizeof(pixel_t));
+  if (! b->scratch) {
+    printf("No mem.\n");
+    exit(-1);
+  }
+  b->n_scratch = n;
+}
+
+static fft_plan_t *builtin_plan(int n, int H, int W, bool in_place,
+                                int sign) {
+  int k;
+  builtin_plan_t *b = malloc_check(sizeof(*b));
+
+  bzero(b, sizeof(*b));
+  b->n = n;
+  b->W = W;
+  b->H = H;
+  b->half_W = (W / 2) + 1;
+  b->real_pitch = in_place? 2 * b->half_W : W;
+  if ((! builtin_cfft_init(&b->rows, (W & 1)? W : W / 2, sign))
+      || (! builtin_cfft_init(&b->cols, H, sign))) {
+    fprintf(stderr, "builtin FFT: cannot transform %dx%d\n", W, H);
+    exit(1);
+  }
+  b->split = malloc_check(2 * b->half_W * sizeof(pixel_t));
+  for (k = 0; k < b->half_W; k++) {
+    b->split[2 * k] = cos(-2 * M_PI * k / W);
+    b->split[2 * k + 1] = sin(-2 * M_PI * k / W);
+  }
+  b->serial = (builtin_workers.n < 2);
+  b->scratch_len = 4 * (size_t)max(b->rows.n, H * BUILTIN_LANES);
+  builtin_plan_scratch(b);
+  return (fft_plan_t*)b;
+}
+
+static fft_plan_t *builtin_plan_r2c(int H, int W, pixel_t *in,
+                                    FFTW(complex) *out, unsigned flags) {
+  return builtin_plan(1, H, W, (void*)in == (void*)out, -1);
+}
+
+static fft_plan_t *builtin_plan_c2r(int H, int W, FFTW(complex) *in,
+                                    pixel_t *out, unsigned flags) {
+  return builtin_plan(1, H, W, (void*)in == (void*)out, 1);
+}
+
+static fft_plan_t *builtin_plan_many_r2c(int n, int H, int W, pixel_t *in,
+                                         FFTW(complex) *out, unsigned flags) {
+  return builtin_plan(n, H, W, false, -1);
+}
+
+static fft_plan_t *builtin_plan_many_c2r(int n, int H, int W,
+                                         FFTW(complex) *in, pixel_t *out,
+                                         unsigned flags) {
+  return builtin_plan(n, H, W, false, 1);
+}
+
+static void builtin_destroy(fft_plan_t *plan) {
+  builtin_plan_t *b = (builtin_plan_t*)plan;
+  builtin_cfft_destroy(&b->rows);
+  builtin_cfft_destroy(&b->cols);
+  free(b->split);
+  free(b->scratch);
+  free(b);
+}
+
+/* The scratch of the worker thread that runs the slice starting at from. */
+static pixel_t *builtin_scratch(builtin_plan_t *b, int from) {
+  return b->scratch + workers_slot(&builtin_workers, from) * b->scratch_len;
+}
+
+/* Real rows [from / half_W, to / half_W) to their half spectra. */
+static void builtin_rows_r2c(void *arg, int from, int to) {
+  builtin_plan_t *b = arg;
+  int W = b->W;
+  int M = W / 2;
+  int n = b->rows.n;
+  int x, y, k;
+  pixel_t *tmp = builtin_scratch(b, from);
+
+  for (y = from / b->half_W; y < to / b->half_W; y++) {
+    const pixel_t *in = b->real + (size_t)y * b->real_pitch;
+    pixel_t *out = b->cplx + 2 * (size_t)y * b->half_W;
+    pixel_t *z;
+
+    if (W & 1) {
+      for (x = 0; x < W; x++) {
+        tmp[2 * x] = in[x];
+        tmp[2 * x + 1] = 0;
+      }
+      z = builtin_cfft(&b->rows, tmp, tmp + 2 * n, 1);
+      memcpy(out, z, 2 * b->half_W * sizeof(pixel_t));
+      continue;
+    }
+
+    // z[k] = in[2k] + i in[2k+1] is the row as it is in memory.
+    memcpy(tmp, in, W * sizeof(pixel_t));
+    z = builtin_cfft(&b->rows, tmp, tmp + 2 * n, 1);
+    // X[k] = E[k] + w^k O[k], with the spectra of the even and odd pixels
+    // E[k] = (Z[k] + conj(Z[M-k])) / 2 and O[k] = (Z[k] - conj(Z[M-k])) / 2i.
+    for (k = 0; k <= M; k++) {
+      const pixel_t *zk = z + 2 * (k % M);
+      const pixel_t *zc = z + 2 * ((M - k) % M);
+      pixel_t er = (zk[0] + zc[0]) / 2;
+      pixel_t ei = (zk[1] - zc[1]) / 2;
+      pixel_t odr = (zk[1] + zc[1]) / 2;
+      pixel_t odi = -(zk[0] - zc[0]) / 2;
+      pixel_t wr = b->split[2 * k];
+      pixel_t wi = b->split[2 * k + 1];
+      out[2 * k] = er + odr * wr - odi * wi;
+      out[2 * k + 1] = ei + odr * wi + odi * wr;
+    }
+  }
+}
+
+/* Half spectra of rows [from / half_W, to / half_W) back to real rows. */
+static void builtin_rows_c2r(void *arg, int from, int to) {
+  builtin_plan_t *b = arg;
+  int W = b->W;
+  int M = W / 2;
+  int n = b->rows.n;
+  int x, y, k;
+  pixel_t *tmp = builtin_scratch(b, from);
+
+  for (y = from / b->half_W; y < to / b->half_W; y++) {
+    const pixel_t *in = b->cplx + 2 * (size_t)y * b->half_W;
+    pixel_t *out = b->real + (size_t)y * b->real_pitch;
+    pixel_t *z;
+
+    if (W & 1) {
+      // the whole hermitian spectrum.
+      memcpy(tmp, in, 2 * b->half_W * sizeof(pixel_t));
+      for (k = 1; k < b->half_W; k++) {
+        tmp[2 * (W - k)] = in[2 * k];
+        tmp[2 * (W - k) + 1] = -in[2 * k + 1];
+      }
+      z = builtin_cfft(&b->rows, tmp, tmp + 2 * n, 1);
+      for (x = 0; x < W; x++)
+        out[x] = z[2 * x];
+      continue;
+    }
+
+    // the inverse of the split above, times two, so that the inverse FFT of
+    // M points scales by W like FFTW's does.
+    for (k = 0; k < M; k++) {
+      const pixel_t *xk = in + 2 * k;
+      const pixel_t *xc = in + 2 * (M - k);
+      pixel_t er = xk[0] + xc[0];
+      pixel_t ei = xk[1] - xc[1];
+      pixel_t dr = xk[0] - xc[0];
+      pixel_t di = xk[1] + xc[1];
+      // O = d * conj(w^k)
+      pixel_t wr = b->split[2 * k];
+      pixel_t wi = b->split[2 * k + 1];
+      pixel_t odr = dr * wr + di * wi;
+      pixel_t odi = di * wr - dr * wi;
+      // Z = E + i O
+      tmp[2 * k] = er - odi;
+      tmp[2 * k + 1] = ei + odr;
+    }
+    z = builtin_cfft(&b->rows, tmp, tmp + 2 * n, 1);
+    memcpy(out, z, W * sizeof(pixel_t));
+  }
+}
+
+/* Columns of blocks [from / (H * BUILTIN_LANES), to / (H * BUILTIN_LANES)),
+ * in place, counting the blocks of all canvases one after the other. */
+static void builtin_cols(void *arg, int from, int to) {
+  builtin_plan_t *b = arg;
+  int H = b->H;
+  int y, l, i;
+  int block = H * BUILTIN_LANES;
+  int blocks = (b->half_W + BUILTIN_LANES - 1) / BUILTIN_LANES;
+  pixel_t *tmp = builtin_scratch(b, from);
+
+  for (i = from / block; i < to / block; i++) {
+    int x0 = (i % blocks) * BUILTIN_LANES;
+    int L = min(BUILTIN_LANES, b->half_W - x0);
+    pixel_t *col = b->cplx + 2 * ((size_t)(i / blocks) * H * b->half_W + x0);
+    for (y = 0; y < H; y++) {
+      for (l = 0; l < 2 * L; l++)
+        tmp[2 * L * y + l] = col[2 * (size_t)y * b->half_W + l];
+    }
+    pixel_t *z = builtin_cfft(&b->cols, tmp, tmp + 2 * block, L);
+    for (y = 0; y < H; y++) {
+      for (l = 0; l < 2 * L; l++)
+        col[2 * (size_t)y * b->half_W + l] = z[2 * L * y + l];
+    }
+  }
+}
+
+/* func over [0, len) of plan b, on the pool unless b is serial. */
+static void builtin_run(builtin_plan_t *b, workers_func_t func, int len,
+                        int align) {
+  if (b->serial)
+    func(b, 0, len);
+  else
+    workers_run(&builtin_workers, func, b, len, align);
+}
+
+static void builtin_run_cols(builtin_plan_t *b) {
+  int blocks = (b->half_W + BUILTIN_LANES - 1) / BUILTIN_LANES;
+  builtin_run(b, builtin_cols, b->n * blocks * b->H * BUILTIN_LANES,
+              b->H * BUILTIN_LANES);
+}
+
+static void builtin_r2c(fft_plan_t *plan, pixel_t *in, FFTW(complex) *out) {
+  builtin_plan_t *b = (builtin_plan_t*)plan;
+  b->real = in;
+  b->cplx = (pixel_t*)out;
+  builtin_plan_scratch(b);
+  builtin_run(b, builtin_rows_r2c, b->n * b->H * b->half_W, b->half_W);
+  builtin_run_cols(b);
+}
+
+static void builtin_c2r(fft_plan_t *plan, FFTW(complex) *in, pixel_t *out) {
+  builtin_plan_t *b = (builtin_plan_t*)plan;
+  b->real = out;
+  b->cplx = (pixel_t*)in;
+  builtin_plan_scratch(b);
+  builtin_run_cols(b);
+  builtin_run(b, builtin_rows_c2r, b->n * b->H * b->half_W, b->half_W);
+}
+
+fft_backend_t builtin_backend = {
+  "builtin", builtin_fits, builtin_threads, builtin_cleanup,
+  builtin_malloc, builtin_free,
+  builtin_plan_r2c, builtin_plan_c2r,
+  builtin_plan_many_r2c, builtin_plan_many_c2r,
+  builtin_r2c, builtin_c2r, builtin_destroy
+};
@@ -0,0 +1,173 @@
+/* burnscope_drift.c
+ * (c) 2014 Neels Hofmeyr <neels@hofmeyr.de>
+ *
+ * This file is part of burnscope, published under the GNU General Public
+ * License v3.
+ */
+
+/* Compare two state files written by burnscope_fft -S, frame by frame. Meant
+ * to quantify how far the float engine (burnscope_fftf) drifts away from the
+ * double engine for identical parameters and random seed, e.g.:
+ *
+ *   ./burnscope_fft  -H -g 640x480 -r 42 -n 500 -S double.state
+ *   ./burnscope_fftf -H -g 640x480 -r 42 -n 500 -S float.state
+ *   ./burnscope_drift double.state float.state
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <math.h>
+#include <unistd.h>
+
+#define PALETTE_LEN_BITS 12
+#define PALETTE_LEN (1 << PALETTE_LEN_BITS)
+
+const int state_file_id = 0x23316;
+
+typedef struct {
+  FILE *f;
+  const char *path;
+  int W;
+  int H;
+  int pixel_size;
+  void *frame;
+} state_file_t;
+
+static void *malloc_check(size_t len) {
+  void *p;
+  p = malloc(len);
+  if (! p) {
+    printf("No mem.\n");
+    exit(-1);
+  }
+  return p;
+}
+
+bool state_open(state_file_t *s, const char *path) {
+  int hdr[4];
+  s->path = path;
+  s->f = fopen(path, "r");
+  if (! s->f) {
+    fprintf(stderr, "cannot open file: %s\n", path);
+    return false;
+  }
+  if ((fread(hdr, sizeof(hdr), 1, s->f) != 1) || (hdr[0] != state_file_id)) {
+    fprintf(stderr, "This does not appear to be a burnscope state file: %s\n", path);
+    return false;
+  }
+  s->W = hdr[1];
+  s->H = hdr[2];
+  s->pixel_size = hdr[3];
+  if ((s->pixel_size != sizeof(float)) && (s->pixel_size != sizeof(double))) {
+    fprintf(stderr, "Unknown pixel size %d: %s\n", s->pixel_size, path);
+    return false;
+  }
+  s->frame = malloc_check((size_t)s->W * s->H * s->pixel_size);
+  printf("%s: %dx%d %s\n", path, s->W, s->H,
+         s->pixel_size == sizeof(float)? "float" : "double");
+  return true;
+}
+
+bool state_read(state_file_t *s) {
+  return fread(s->frame, s->pixel_size, (size_t)s->W * s->H, s->f)
+         == (size_t)s->W * s->H;
+}
+
+double state_pixel(state_file_t *s, int i) {
+  if (s->pixel_size == sizeof(float))
+    return ((float*)s->frame)[i];
+  return ((double*)s->frame)[i];
+}
+
+/* The palette index render() would show for a pixel value. */
+unsigned int palette_index(double pix) {
+  if (pix >= PALETTE_LEN)
+    pix -= (int)pix;
+  else
+  if (pix < 0.001)
+    pix = 0;
+  return (unsigned int)pix;
+}
+
+int main(int argc, char *argv[])
+{
+  int every = 1;
+  int c;
+
+  while ((c = getopt(argc, argv, "he:")) != -1) {
+    switch (c) {
+      case 'e':
+        every = atoi(optarg);
+        break;
+
+      default:
+        printf(
+"Usage: burnscope_drift [-e N] a.state b.state\n"
+"Compare two state files written by 'burnscope_fft -S', frame by frame.\n"
+"  -e N     Print only every Nth frame (summary is over all frames).\n"
+"Columns: frame, max and RMS difference of pixel values, and the percentage\n"
+"of pixels that show a different palette color.\n"
+);
+        return c == 'h'? 0 : 1;
+    }
+  }
+
+  if ((argc - optind) != 2) {
+    fprintf(stderr, "need two state files, see -h\n");
+    return 1;
+  }
+
+  state_file_t a, b;
+  if ((! state_open(&a, argv[optind])) || (! state_open(&b, argv[optind + 1])))
+    return 1;
+
+  if ((a.W != b.W) || (a.H != b.H)) {
+    fprintf(stderr, "dimensions differ: %dx%d vs. %dx%d\n", a.W, a.H, b.W, b.H);
+    return 1;
+  }
+
+  int n = a.W * a.H;
+  int frame = 0;
+  int first_visible = -1;
+  double worst = 0;
+
+  printf("frame       max_diff       rms_diff  colors_differ\n");
+
+  while (state_read(&a) && state_read(&b)) {
+    int i;
+    double max_diff = 0;
+    double sum_sq = 0;
+    int idx_differ = 0;
+
+    for (i = 0; i < n; i++) {
+      double va = state_pixel(&a, i);
+      double vb = state_pixel(&b, i);
+      double d = fabs(va - vb);
+      if (d > max_diff)
+        max_diff = d;
+      sum_sq += d * d;
+      if (palette_index(va) != palette_index(vb))
+        idx_differ ++;
+    }
+
+    if (max_diff > worst)
+      worst = max_diff;
+    if ((first_visible < 0) && idx_differ)
+      first_visible = frame;
+
+    if ((frame % every) == 0)
+      printf("%5d %14.6g %14.6g %13.3f%%\n", frame, max_diff,
+             sqrt(sum_sq / n), 100. * idx_differ / n);
+    frame ++;
+  }
+
+  printf("%d frames compared, largest difference %g\n", frame, worst);
+  if (first_visible >= 0)
+    printf("colors first differ in frame %d\n", first_visible);
+  else
+    printf("colors never differ\n");
+  return 0;
+}
+
+// vim: ts=2 sw=2 et
@@ -5,7 +5,10 @@
  * License v3.
  */
 
+#define _GNU_SOURCE
+#ifndef BURNSCOPE_NO_FFTW
 #include <fftw3.h>
+#endif
 #include <math.h>
 #include <time.h>
 #include <stdlib.h>
@@ -20,13 +23,34 @@
 #include <sys/types.h>
 #include <sndfile.h>
 #include <limits.h>
+#include <signal.h>
+#include <sched.h>
 
 #include <stdint.h>
 
 #define min(A,B) ((A) > (B)? (B) : (A))
 #define max(A,B) ((A) > (B)? (A) : (B))
 
+/* Build with -DBURNSCOPE_FLOAT for a single precision engine (see the
+ * burnscope_fftf make target). Use FFTW(name) instead of fftw_name. */
+#ifdef BURNSCOPE_FLOAT
+typedef float pixel_t;
+#define FFTW(name) fftwf_ ## name
+#define PRECISION_NAME "float"
+#else
 typedef double pixel_t;
+#define FFTW(name) fftw_ ## name
+#define PRECISION_NAME "double"
+#endif
+
+/* Build with -DBURNSCOPE_NO_FFTW to do all FFTs with the builtin backend and
+ * link no FFTW library, see fft_backend.h. */
+#ifdef BURNSCOPE_NO_FFTW
+#ifdef BURNSCOPE_MPI
+#error "the MPI build needs FFTW"
+#endif
+#include "fftw_none.h"
+#endif
 
 static void *malloc_check(size_t len) {
   void *p;
@@ -45,6 +69,7 @@ float frandom(void) {
 
 #include "images.h"
 #include "palettes.h"
+#include "fft_backend.h"
 
 #define SEED_VAL (0.5 * PALETTE_LEN)
 #define MAX_SEED_R (min_W_H/5)
@@ -75,15 +100,175 @@ char *symmetry_name[SYMMETRY_KINDS] = {
 
 int W = 1024;
 int H = 768;
+/* The largest width and height that is transformed as a whole. Larger
+ * canvases, up to TILED_MAX_PIXELS, use the tiled engine. */
+#define MAX_PIXELS 10000
 int min_W_H, max_W_H;
+/* -M: the number of independent W x H canvases, shown side by side on a
+ * wall of wall_cols x wall_rows tiles. pixbuf then holds all canvases one
+ * after the other (see multi.h). */
+int n_instances = 1;
+int wall_cols = 1;
+int wall_rows = 1;
+/* -c: three canvases are the red, green and blue channels of one view
+ * instead, stepped together like -M. Their palette indexes lie one below the
+ * other in the frames (wall_rows is 3), and render() combines them. In
+ * rgb_direct mode a channel's value is its brightness, in rgb_palette mode
+ * each channel takes its part of the palette colour of its own value. */
+typedef enum {
+  rgb_off = 0,
+  rgb_direct,
+  rgb_palette
+} rgb_mode_t;
+rgb_mode_t rgb_mode = rgb_off;
+/* The palette index buffers hold W x H, or the whole wall: idx_W x idx_H.
+ * What is rendered is the view_W x view_H part of it at view_x, view_y: all
+ * of it, unless -G simulates a larger canvas than asked for. */
+int idx_W;
+int idx_H;
+int view_W;
+int view_H;
+int view_x = 0;
+int view_y = 0;
+/* -Z: assume zeros around the view instead of wrapping around its edges. The
+ * canvas is padded by at least zero_pad pixels, which is cleared before each
+ * step, and the apex radius is limited to it. 0 to wrap. */
+int zero_pad = 0;
 pixel_t *pixbuf = NULL;
-int pixbuf_bytes = 0;
-pixel_t *apex = NULL;
-fftw_complex *pixbuf_f;
-fftw_plan plan_backward;
-fftw_plan plan_forward;
-fftw_complex *apex_f;
-fftw_plan plan_apex;
+size_t pixbuf_bytes = 0;
+/* Row stride of pixbuf in pixels. Equals W, except in memory-lean mode (-L),
+ * where pixbuf is transformed in place and its rows are padded to
+ * 2 * (W/2 + 1) to hold the complex spectrum. */
+int pitch;
+bool lean = false;
+FFTW(complex) *pixbuf_f;
+/* A copy of the spectrum that plan_backward turned into pixbuf (c2r destroys
+ * its input), so that the fft engine can skip plan_forward when pixbuf did
+ * not change since. NULL in memory-lean mode. See engine_fft_step(). */
+FFTW(complex) *resident_f = NULL;
+bool resident_valid = false;
+fft_plan_t *plan_backward;
+fft_plan_t *plan_forward;
+/* -B: memory budget for the FFT buffers besides the canvas, 0 for none. */
+int mem_budget_mb = 0;
+/* The tile size of the tiled engine (see tiled.h), which takes over when the
+ * spectra of the whole canvas exceed the budget, or the canvas is too large
+ * for them; 0 if the canvas is transformed as a whole. pixbuf_f, resident_f,
+ * plan_forward and plan_backward are then NULL. */
+int tiled_T = 0;
+/* The rows of the canvas that pixbuf holds: all of them, except in the MPI
+ * build, where each rank holds a slab (see slab.h). */
+int slab_y0 = 0;
+int slab_rows;
+/* Whether this process runs the window, controls and output; false for all
+ * but rank 0 in the MPI build. */
+bool slab_root = true;
+/* The current kernel spectrum, in the apex cache. For kernels that are even
+ * about the origin the spectrum is real, and only its real part is kept in
+ * apex_re (apex_f is then NULL, and vice versa). */
+FFTW(complex) *apex_f;
+pixel_t *apex_re;
+/* see dct.h */
+bool apex_axes_even;
+/* changes whenever make_apex() switches to another kernel. */
+unsigned int apex_serial = 0;
+/* the parameters of the current kernel. */
+double apex_now_r;
+char apex_now_opt;
+/* the -K kernel in use, or -1 for the disc of apex_now_r and apex_now_opt. */
+int apex_now_kernel = -1;
+fft_plan_t *plan_apex;
+/* The kernel and its spectrum are apex_W x apex_H: the canvas, or a tile of
+ * the tiled engine. The kernel reaches at most apex_r_max pixels. */
+int apex_W;
+int apex_H;
+int apex_r_max;
+/* The apex spectrum is normalized to a gain of 1. The burn factor is applied
+ * as scalar during the complex multiplication, so that the kernel spectrum
+ * needs to be recalculated only when its shape changes. */
+double apex_gain = 1.;
+/* the burn amount apex_gain was made of. */
+double apex_burn = 0;
+
+#include "workers.h"
+#include "builtin_fft.h"
+
+/* -X: the backend of all FFTs but the dct engine's. */
+fft_backend_t *fft_backends[] = {
+#ifndef BURNSCOPE_NO_FFTW
+  &fftw_backend,
+#endif
+  &builtin_backend,
+};
+#define N_FFT_BACKENDS (sizeof(fft_backends) / sizeof(fft_backends[0]))
+#ifdef BURNSCOPE_NO_FFTW
+fft_backend_t *fft_backend = &builtin_backend;
+#else
+fft_backend_t *fft_backend = &fftw_backend;
+#endif
+#include "spectral.h"
+#ifndef BURNSCOPE_NO_FFTW
+#include "dct.h"
+#endif
+#include "stencil.h"
+#include "apex_cache.h"
+#include "multi.h"
+#include "tiled.h"
+#include "regions.h"
+#ifdef BURNSCOPE_MPI
+#include "slab.h"
+#endif
+
+/* the kernel's taps for the stencil engine, or NULL if it is too large. */
+const stencil_tap_t *apex_taps;
+int apex_n_taps;
+int apex_taps_r;
+
+#ifndef BURNSCOPE_NO_FFTW
+/* Fundamental domain engines for symm_x, symm_y and symm_xy, planned on
+ * first use. */
+dct_t dct[symm_xy + 1];
+#endif
+
+/* The stencil engine, set up on first use. */
+stencil_t stencil;
+
+/* The batched engine for -M. */
+multi_t multi;
+
+/* -M N,spread[,mix]: how multi_fill() derives the parameters of each canvas
+ * from the controls, see the usage text. */
+double multi_spread = 0;
+bool multi_mix = false;
+/* A canvas whose disc no canvas before it has keeps a copy of its spectrum
+ * from the apex cache, which may evict it while the others get theirs;
+ * multi_r[i] and multi_opt[i] tell which disc multi_spectra[i] holds, or
+ * multi_r[i] is 0 if none yet. */
+void **multi_spectra = NULL;
+bool *multi_real;
+double *multi_r;
+char *multi_opt;
+
+/* The overlap-save engine, for tiled_T. */
+tiled_t tiled;
+
+/* -V: the masks that weigh the -K kernels across the canvas, read from the
+ * images in regions_dir, one per kernel in the same order. */
+const char *regions_dir = NULL;
+regions_t regions;
+
+apex_cache_t apex_cache;
+int apex_cache_mb = 256;
+
+/* -K: kernels from the images in a directory (PNG, or raw *.f32, see
+ * images.h), centred on the origin, besides the disc of make_apex(). Their
+ * spectra are all computed at startup into the kernel bank, an apex cache
+ * large enough to never evict, so switching between them costs no FFT.
+ * p.kernel picks one of them, or the disc if -1. */
+const char *kernels_dir = NULL;
+image_t *kernel_images = NULL;
+int n_kernels = 0;
+apex_cache_t kernel_bank;
 
 typedef enum {
   ao_left = 2,
@@ -92,48 +277,424 @@ typedef enum {
   ao_down = 1,
 } apex_opt_t;
 
-void make_apex(double apex_r, double burn_amount, char apex_opt);
+void make_apex(double apex_r, char apex_opt);
+void build_apex(pixel_t *apex, const int W, const int H, double apex_r,
+                char apex_opt);
+bool apex_is_even(const pixel_t *apex, const int W, const int H, bool flip_x,
+                  bool flip_y);
+double burn_gain(double burn_amount);
+
+/* Number of threads FFTW uses, including the main thread. 0 means auto. */
+int fft_threads = 0;
+
+/* Threads for the loops between the FFTs, as many as FFTW uses. */
+workers_t workers;
+spectral_kernel_t *spectral;
+
+/* CPU quota of this process's cgroup in CPUs (e.g. a container started with
+ * --cpus=2.5), or 0 if unlimited or unknown. */
+double cgroup_cpu_quota(void) {
+  FILE *f;
+  long long quota = -1;
+  long long period = 0;
+
+  // cgroup v2: "max 100000" or "250000 100000"
+  f = fopen("/sys/fs/cgroup/cpu.max", "r");
+  if (f) {
+    char q[32];
+    if ((fscanf(f, "%31s %lld", q, &period) == 2) && strcmp(q, "max"))
+      quota = atoll(q);
+    fclose(f);
+  }
+  else {
+    // cgroup v1
+    f = fopen("/sys/fs/cgroup/cpu/cpu.cfs_quota_us", "r");
+    if (f) {
+      if (fscanf(f, "%lld", &quota) != 1)
+        quota = -1;
+      fclose(f);
+    }
+    f = fopen("/sys/fs/cgroup/cpu/cpu.cfs_period_us", "r");
+    if (f) {
+      if (fscanf(f, "%lld", &period) != 1)
+        period = 0;
+      fclose(f);
+    }
+  }
 
-void fft_init(void) {
-  fftw_init_threads();
-  fftw_plan_with_nthreads(4);
+  if ((quota <= 0) || (period <= 0))
+    return 0;
+  return (double)quota / period;
+}
 
-  pixbuf_bytes = W * H * sizeof(pixel_t);
+/* Number of CPUs this process can actually run on: the affinity mask (e.g.
+ * taskset), limited by a cgroup CPU quota. */
+int usable_cpus(void) {
+  int n;
+  cpu_set_t set;
 
-  pixbuf = (pixel_t *) malloc_check(pixbuf_bytes);
-  bzero(pixbuf, pixbuf_bytes);
+  if (sched_getaffinity(0, sizeof(set), &set) == 0)
+    n = CPU_COUNT(&set);
+  else
+    n = sysconf(_SC_NPROCESSORS_ONLN);
 
+  double quota = cgroup_cpu_quota();
+  if (quota > 0)
+    n = min(n, (int)ceil(quota));
+
+  return max(1, n);
+}
+
+/* Pick the number of FFT threads, leaving one CPU each to the render thread
+ * and, if writing a video stream, to the save thread. */
+int auto_fft_threads(bool saving) {
+  int cpus = usable_cpus();
+  int reserved = 1 + (saving? 1 : 0);
+  int n = max(1, cpus - reserved);
+  printf("%d usable CPUs: %d FFT threads\n", cpus, n);
+  return n;
+}
+
+/* The smallest size of at least n whose only prime factors are 2, 3, 5 and
+ * 7, which FFTW transforms fastest. */
+int fft_friendly_size(int n) {
+  for (;; n++) {
+    int m = n;
+    while ((m % 2) == 0) m /= 2;
+    while ((m % 3) == 0) m /= 3;
+    while ((m % 5) == 0) m /= 5;
+    while ((m % 7) == 0) m /= 7;
+    if (m == 1)
+      return n;
+  }
+}
+
+/* Time one forward plus backward FFT of a W x H canvas with threads
+ * threads, planned with the given planner flags, with the -X backend.
+ * Returns ms per frame. */
+double fft_frame_ms(int W, int H, int threads, unsigned flags) {
   int half_W = (W / 2) + 1;
-  apex = (pixel_t*)malloc_check(pixbuf_bytes);
-  bzero(apex, pixbuf_bytes);
-  apex_f = fftw_malloc(sizeof(fftw_complex) * H * half_W);
-  plan_apex = fftw_plan_dft_r2c_2d(H, W, apex, apex_f, FFTW_ESTIMATE);
+  pixel_t *buf = fft_backend->malloc((size_t)W * H * sizeof(pixel_t));
+  FFTW(complex) *buf_f = fft_backend->malloc(sizeof(FFTW(complex))
+                                             * H * half_W);
 
-  pixbuf_f = fftw_malloc(sizeof(fftw_complex) * H * half_W);
-  plan_forward = fftw_plan_dft_r2c_2d(H, W, pixbuf, pixbuf_f, FFTW_ESTIMATE);
-  plan_backward = fftw_plan_dft_c2r_2d(H, W, pixbuf_f, pixbuf, FFTW_ESTIMATE);
+  if ((! buf) || (! buf_f)) {
+    printf("No mem.\n");
+    exit(-1);
+  }
 
-  make_apex(8.01, 1.005, 0);
+  fft_backend->threads(threads);
+  fft_plan_t *fw = fft_backend->plan_r2c(H, W, buf, buf_f, flags);
+  fft_plan_t *bw = fft_backend->plan_c2r(H, W, buf_f, buf, flags);
+  bzero(buf, (size_t)W * H * sizeof(pixel_t));
+
+  // warm up, then run for at least a fifth of a second.
+  fft_backend->r2c(fw, buf, buf_f);
+  fft_backend->c2r(bw, buf_f, buf);
+
+  Uint64 freq = SDL_GetPerformanceFrequency();
+  Uint64 start = SDL_GetPerformanceCounter();
+  Uint64 elapsed;
+  int reps = 0;
+  do {
+    fft_backend->r2c(fw, buf, buf_f);
+    fft_backend->c2r(bw, buf_f, buf);
+    reps ++;
+    elapsed = SDL_GetPerformanceCounter() - start;
+  } while ((reps < 3) || (elapsed < freq / 5));
+
+  fft_backend->destroy(fw);
+  fft_backend->destroy(bw);
+  fft_backend->free(buf);
+  fft_backend->free(buf_f);
+  return 1000. * elapsed / freq / reps;
 }
 
-void fft_destroy(void) {
-  fftw_cleanup_threads();
-  fftw_destroy_plan(plan_apex);
-  fftw_destroy_plan(plan_forward);
-  fftw_destroy_plan(plan_backward);
-  free(pixbuf);
-  free(apex);
-  fftw_free(pixbuf_f);
-  fftw_free(apex_f);
-  pixbuf = NULL;
-  apex = NULL;
+/* Time one forward plus backward FFT of the canvas for 1, 2, 4, ... up to
+ * max_threads threads, print the results and return the fastest count. */
+int probe_fft_threads(int max_threads) {
+  int n;
+  int best_n = 1;
+  double best_ms = 0;
+  int probe_W = W;
+  int probe_H = H;
+
+  // a canvas the builtin backend cannot do yet is padded by -G or -Z.
+  if (! fft_backend->fits(W, H)) {
+    probe_W = fft_friendly_size(W);
+    probe_H = fft_friendly_size(H);
+  }
+  printf("Probing FFT threads for %dx%d:\n", probe_W, probe_H);
+
+  for (n = 1; n <= max_threads; n = (n < max_threads)? min(n * 2, max_threads) : n + 1) {
+    double ms = fft_frame_ms(probe_W, probe_H, n, FFTW_ESTIMATE);
+    printf("  %2d threads: %8.3f ms per frame\n", n, ms);
+    if ((n == 1) || (ms < best_ms)) {
+      best_ms = ms;
+      best_n = n;
+    }
+  }
+
+  printf("fastest: %d threads\n", best_n);
+  return best_n;
 }
 
-void make_apex(double apex_r, double burn_amount, char apex_opt) {
-  int x, y;
+/* -Z: the FFT friendly size of at least n + pad. The circular convolution
+ * wraps around through the padding, so pad pixels on one side are enough.
+ * The padding is split evenly on both sides, so that the view stays in the
+ * middle and the symmetry modes mirror it onto itself. */
+int zero_padded_size(int n, int pad) {
+  int padded = fft_friendly_size(n + pad);
+  while ((padded - n) & 1)
+    padded = fft_friendly_size(padded + 1);
+  return padded;
+}
+
+typedef struct {
+  const char *name;
+  unsigned flags;
+} planner_rigor_t;
+
+planner_rigor_t planner_rigors[] = {
+  { "estimate", FFTW_ESTIMATE },
+  { "measure", FFTW_MEASURE },
+  { "patient", FFTW_PATIENT },
+  { "exhaustive", FFTW_EXHAUSTIVE },
+};
+#define PLANNER_RIGORS (sizeof(planner_rigors) / sizeof(planner_rigors[0]))
+planner_rigor_t *planner_rigor = &planner_rigors[0];
+
+/* FFTW wisdom is loaded before planning and saved at exit, so that expensive
+ * planning (-e) is paid only once per machine. NULL means no wisdom file. */
+char *wisdom_path = NULL;
+
+/* Return ~/.cache/burnscope (or $XDG_CACHE_HOME/burnscope), creating it if
+ * necessary, or NULL if there is no home. */
+const char *cache_dir(void) {
+  static char dir[PATH_MAX];
+  const char *cache = getenv("XDG_CACHE_HOME");
+  const char *home = getenv("HOME");
+
+  if (cache && *cache)
+    snprintf(dir, sizeof(dir), "%s/burnscope", cache);
+  else
+  if (home && *home)
+    snprintf(dir, sizeof(dir), "%s/.cache/burnscope", home);
+  else
+    return NULL;
+
+  // create the cache dir and its parent, if necessary.
+  char *slash = strrchr(dir, '/');
+  *slash = 0;
+  mkdir(dir, 0755);
+  *slash = '/';
+  mkdir(dir, 0755);
+  return dir;
+}
+
+/* Default wisdom file location for a W x H canvas, keyed by size, thread
+ * count and precision, in cache_dir(). Returns NULL if there is no place to
+ * put it. */
+char *default_wisdom_path(int W, int H) {
+  static char path[PATH_MAX + 64];
+  const char *dir = cache_dir();
 
-  apex_r = min(apex_r, min_W_H/2 - 2);
+  if (! dir)
+    return NULL;
+
+  snprintf(path, sizeof(path), "%s/fftw-wisdom-" PRECISION_NAME "-%dx%d-t%d",
+           dir, W, H, fft_threads);
+  return path;
+}
+
+/* Add the FFTW wisdom in path, if any, to what FFTW knows. */
+void import_wisdom(const char *path) {
+  if (path && FFTW(import_wisdom_from_filename)(path))
+    printf("FFTW wisdom loaded from %s\n", path);
+}
+
+void fft_init(void) {
+  FFTW(init_threads)();
+  FFTW(plan_with_nthreads)(fft_threads);
+  fft_backend->threads(fft_threads);
+
+  if (slab_root)
+    import_wisdom(wisdom_path);
+#ifdef BURNSCOPE_MPI
+  FFTW(mpi_init)();
+  FFTW(mpi_broadcast_wisdom)(MPI_COMM_WORLD);
+#endif
+
+  if (planner_rigor->flags != FFTW_ESTIMATE) {
+    printf("FFTW planning (%s)...\n", planner_rigor->name);
+    fflush(stdout);
+  }
+
+  int half_W = (W / 2) + 1;
+  size_t spectrum_bytes = sizeof(FFTW(complex)) * H * half_W;
+
+  slab_rows = H;
+  if (tiled_T) {
+    pitch = W;
+    pixbuf_bytes = (size_t)W * H * sizeof(pixel_t);
+    pixbuf = fft_backend->malloc(pixbuf_bytes);
+  }
+  else
+  if (lean) {
+    pitch = 2 * half_W;
+    pixbuf_bytes = spectrum_bytes;
+#ifdef BURNSCOPE_MPI
+    pixbuf_bytes = sizeof(FFTW(complex))
+                   * slab_local_size(H, half_W, &slab_y0, &slab_rows);
+    printf("rank %d of %d: rows %d to %d\n", slab_layout.rank,
+           slab_layout.size, slab_y0, slab_y0 + slab_rows - 1);
+#endif
+    pixbuf = fft_backend->malloc(pixbuf_bytes);
+    pixbuf_f = (FFTW(complex)*)pixbuf;
+  }
+  else {
+    pitch = W;
+    pixbuf_bytes = n_instances * W * H * sizeof(pixel_t);
+    pixbuf = fft_backend->malloc(pixbuf_bytes);
+    pixbuf_f = fft_backend->malloc(spectrum_bytes);
+    resident_f = fft_backend->malloc(spectrum_bytes);
+  }
+  if ((! pixbuf)
+      || ((! tiled_T) && ((! pixbuf_f) || ((! lean) && (! resident_f))))) {
+    printf("No mem.\n");
+    exit(-1);
+  }
+
+  if (tiled_T) {
+    // the tiles are spread across the worker threads, one FFT thread each.
+    fft_backend->threads(1);
+    tiled_init(&tiled, W, H, pitch, tiled_T, fft_threads,
+               planner_rigor->flags);
+    fft_backend->threads(fft_threads);
+    apex_W = apex_H = tiled_T;
+    apex_r_max = tiled.halo;
+  }
+  else {
+    apex_W = W;
+    apex_H = H;
+    apex_r_max = min(W, H) / 2 - 2;
+  }
+  if (zero_pad)
+    apex_r_max = min(apex_r_max, zero_pad);
+
+  // The apex spectrum lives in the apex cache. The kernel is built right in
+  // a cache entry and transformed in place, so there is no separate spatial
+  // apex buffer. plan_apex is only ever executed on cache entries; planning on
+  // pixbuf_f, or a tile buffer of the tiled engine, is fine since it has the
+  // same size and alignment.
+  FFTW(complex) *apex_scratch = tiled_T? (FFTW(complex)*)tiled.bufs[0]
+                                       : pixbuf_f;
+  apex_cache_init(&apex_cache, (size_t)apex_cache_mb << 20,
+                  sizeof(FFTW(complex)) * apex_H * ((apex_W / 2) + 1));
+#ifdef BURNSCOPE_MPI
+  // pixbuf_f is only a slab. Each rank keeps the whole kernel spectrum and
+  // multiplies with its slab of it.
+  apex_scratch = FFTW(malloc)(apex_cache.complex_bytes);
+  if (! apex_scratch) {
+    printf("No mem.\n");
+    exit(-1);
+  }
+#endif
+  plan_apex = fft_backend->plan_r2c(apex_H, apex_W, (pixel_t*)apex_scratch,
+                                    apex_scratch, planner_rigor->flags);
+#ifdef BURNSCOPE_MPI
+  FFTW(free)(apex_scratch);
+#endif
+
+  if (n_instances > 1) {
+    multi_init(&multi, n_instances, W, H, pixbuf, planner_rigor->flags);
+  }
+  else
+  if (! tiled_T) {
+#ifdef BURNSCOPE_MPI
+    plan_forward = fftw_backend_wrap(
+        FFTW(mpi_plan_dft_r2c_2d)(H, W, pixbuf, pixbuf_f, MPI_COMM_WORLD,
+                                  planner_rigor->flags),
+        pixbuf, pixbuf_f);
+    plan_backward = fftw_backend_wrap(
+        FFTW(mpi_plan_dft_c2r_2d)(H, W, pixbuf_f, pixbuf, MPI_COMM_WORLD,
+                                  planner_rigor->flags),
+        pixbuf_f, pixbuf);
+#else
+    plan_forward = fft_backend->plan_r2c(H, W, pixbuf, pixbuf_f,
+                                         planner_rigor->flags);
+    plan_backward = fft_backend->plan_c2r(H, W, pixbuf_f, pixbuf,
+                                          planner_rigor->flags);
+#endif
+  }
+
+  workers_init(&workers, fft_threads);
+  spectral = spectral_select(NULL);
+  printf("spectral multiply: %s, %d threads\n", spectral->name, fft_threads);
+
+  // planning other than FFTW_ESTIMATE scribbles on the arrays.
+  bzero(pixbuf, pixbuf_bytes);
+
+  make_apex(8.01, 0);
+  apex_gain = burn_gain(1.005);
+}
+
+void fft_destroy(void) {
+#ifdef BURNSCOPE_MPI
+  FFTW(mpi_gather_wisdom)(MPI_COMM_WORLD);
+#endif
+  if (wisdom_path && slab_root) {
+    if (FFTW(export_wisdom_to_filename)(wisdom_path))
+      printf("FFTW wisdom saved to %s\n", wisdom_path);
+    else
+      fprintf(stderr, "Cannot write FFTW wisdom to %s\n", wisdom_path);
+  }
+  FFTW(cleanup_threads)();
+  fft_backend->destroy(plan_apex);
+  if (plan_forward)
+    fft_backend->destroy(plan_forward);
+  if (plan_backward)
+    fft_backend->destroy(plan_backward);
+  multi_destroy(&multi);
+  if (multi_spectra) {
+    int i;
+    for (i = 0; i < n_instances; i++)
+      FFTW(free)(multi_spectra[i]);
+    free(multi_spectra);
+    free(multi_real);
+    free(multi_r);
+    free(multi_opt);
+    multi_spectra = NULL;
+  }
+  tiled_destroy(&tiled);
+  fft_backend->cleanup();
+  regions_destroy(&regions);
+  if (! lean) {
+    fft_backend->free(pixbuf_f);
+    fft_backend->free(resident_f);
+  }
+  fft_backend->free(pixbuf);
+  apex_cache_destroy(&apex_cache);
+  apex_cache_destroy(&kernel_bank);
+  workers_destroy(&workers);
+#ifndef BURNSCOPE_NO_FFTW
+  int i;
+  for (i = 0; i <= symm_xy; i++)
+    dct_destroy(&dct[i]);
+#endif
+  stencil_destroy(&stencil);
+#ifdef BURNSCOPE_MPI
+  FFTW(mpi_cleanup)();
+#endif
+  pixbuf = NULL;
+  pixbuf_f = NULL;
+  resident_f = NULL;
+  resident_valid = false;
+  apex_f = NULL;
+  apex_re = NULL;
+}
 
+double burn_gain(double burn_amount) {
   double burn_factor = burn_amount + 1.0;
 
   if (fabs(burn_factor) < minuscule) {
@@ -142,13 +703,149 @@ void make_apex(double apex_r, double burn_amount, char apex_opt) {
     else
       burn_factor = minuscule;
   }
+  return burn_factor;
+}
+
+/* Transform the kernel that was built in the spectrum buffer of entry e of
+ * cache c, noting its symmetries and stencil taps first. */
+void apex_transform(apex_cache_t *c, apex_cache_entry_t *e) {
+  bool even = apex_is_even(e->spectrum, apex_W, apex_H, true, true);
+  e->axes_even = even
+                 && apex_is_even(e->spectrum, apex_W, apex_H, true, false)
+                 && apex_is_even(e->spectrum, apex_W, apex_H, false, true);
+  // the FFT round trip scales by apex_W*apex_H, which the kernel makes up
+  // for.
+  e->taps = stencil_taps(e->spectrum, apex_W, apex_H,
+                         2 * ((apex_W / 2) + 1), apex_W * apex_H,
+                         &e->n_taps, &e->taps_r);
+  fft_backend->r2c(plan_apex, e->spectrum, e->spectrum);
+  if (even)
+    apex_cache_make_real(c, e);
+}
+
+/* Make the kernel of entry e the current one. */
+void apex_use(apex_cache_entry_t *e) {
+  apex_f = e->real? NULL : e->spectrum;
+  apex_re = e->real? e->spectrum : NULL;
+  apex_axes_even = e->axes_even;
+  apex_taps = e->taps;
+  apex_n_taps = e->n_taps;
+  apex_taps_r = e->taps_r;
+  apex_serial ++;
+}
+
+void make_apex(double apex_r, char apex_opt) {
+  apex_cache_entry_t *e = apex_cache_find(&apex_cache, apex_r, apex_opt,
+                                          apex_W, apex_H);
+  if (! e) {
+    e = apex_cache_add(&apex_cache, apex_r, apex_opt, apex_W, apex_H);
+    build_apex(e->spectrum, apex_W, apex_H, apex_r, apex_opt);
+    apex_transform(&apex_cache, e);
+  }
+
+  apex_use(e);
+  apex_now_r = apex_r;
+  apex_now_opt = apex_opt;
+  apex_now_kernel = -1;
+}
+
+/* Build the W x H kernel from an image centred on the origin, in a spectrum
+ * buffer like build_apex(), and normalize it the same way. Returns false if
+ * its pixels add up to zero. */
+bool build_kernel(pixel_t *apex, const int W, const int H,
+                  const image_t *img) {
+  int x, y;
+  const int apex_pitch = 2 * ((W / 2) + 1);
+  double apex_sum = 0;
+  bzero(apex, apex_cache.complex_bytes);
+
+  for (y = 0; y < img->height; y++) {
+    int ay = (y - img->height / 2 + H) % H;
+    for (x = 0; x < img->width; x++) {
+      int ax = (x - img->width / 2 + W) % W;
+      pixel_t v = img->data[y * img->width + x];
+      apex[ax + ay * apex_pitch] = v;
+      apex_sum += v;
+    }
+  }
+
+  if (fabs(apex_sum) < 1e-6)
+    return false;
+
+  double apex_mul = (1. / (W*H)) / apex_sum;
+
+  for (y = 0; y < H; y++) {
+    pixel_t *row = apex + y * apex_pitch;
+    for (x = 0; x < W; x++) {
+      row[x] *= apex_mul;
+    }
+  }
+  return true;
+}
+
+/* Read the -K kernels, shrunk to reach at most apex_r_max pixels, and
+ * transform them. Call after fft_init(). */
+void load_kernels(void) {
+  int k;
+  int side = 2 * apex_r_max + 1;
+
+  printf("kernels in %s:\n", kernels_dir);
+  read_images(kernels_dir, &kernel_images, &n_kernels, side, side);
+  if (! n_kernels)
+    return;
+
+  apex_cache_init(&kernel_bank, n_kernels * apex_cache.complex_bytes,
+                  apex_cache.complex_bytes);
+  for (k = 0; k < n_kernels; k++) {
+    apex_cache_entry_t *e = apex_cache_add(&kernel_bank, k, 0, apex_W,
+                                           apex_H);
+    if (! build_kernel(e->spectrum, apex_W, apex_H, &kernel_images[k])) {
+      fprintf(stderr, "kernel adds up to zero: %s\n",
+              kernel_images[k].path);
+      exit(1);
+    }
+    apex_transform(&kernel_bank, e);
+  }
+}
+
+/* Make -K kernel k the current one. */
+void use_kernel(int k) {
+  apex_use(apex_cache_find(&kernel_bank, k, 0, apex_W, apex_H));
+  apex_now_kernel = k;
+}
+
+/* Is the kernel the same when mirrored along x and/or y, e.g. apex[-x,-y] ==
+ * apex[x,y]? If so for both at once, its spectrum is real. */
+bool apex_is_even(const pixel_t *apex, const int W, const int H, bool flip_x,
+                  bool flip_y) {
+  int x, y;
+  const int apex_pitch = 2 * ((W / 2) + 1);
+  for (y = 0; y < H; y++) {
+    const pixel_t *row = apex + y * apex_pitch;
+    const pixel_t *mrow = apex + (flip_y? (H - y) % H : y) * apex_pitch;
+    for (x = 0; x < W; x++) {
+      if (row[x] != mrow[flip_x? (W - x) % W : x])
+        return false;
+    }
+  }
+  return true;
+}
+
+/* Build the W x H kernel in a spectrum buffer, with padded rows, to be
+ * transformed in place. */
+void build_apex(pixel_t *apex, const int W, const int H, double apex_r,
+                char apex_opt) {
+  int x, y;
+  const int apex_pitch = 2 * ((W / 2) + 1);
+  bzero(apex, apex_cache.complex_bytes);
+
+  apex_r = min(apex_r, apex_r_max);
 
   double apex_sum = 0;
   double apex_r2 = apex_r * apex_r;
   int apex_r_i = apex_r;
 
-  static int last_apex_r = 0;
-  int overwrite_r = max(apex_r_i, last_apex_r);
+  int overwrite_r = apex_r_i;
   int W2 = W >> 1;
   int H2 = H >> 1;
 
@@ -199,7 +896,7 @@ void make_apex(double apex_r, double burn_amount, char apex_opt) {
 
 
       apex_sum += v;
-      apex[x+y*W] = v;
+      apex[x+y*apex_pitch] = v;
 
       if (y == overwrite_r)
         y = H - overwrite_r - 1;
@@ -268,26 +965,26 @@ void make_apex(double apex_r, double burn_amount, char apex_opt) {
   }
 #endif
 
-  double apex_mul = (burn_factor / (W*H)) / apex_sum;
+  double apex_mul = (1. / (W*H)) / apex_sum;
 
-  y = W * H;
-  for (x = 0; x < y; x++) {
-    apex[x] *= apex_mul;
+  for (y = 0; y < H; y++) {
+    pixel_t *row = apex + y * apex_pitch;
+    for (x = 0; x < W; x++) {
+      row[x] *= apex_mul;
+    }
   }
-  fftw_execute(plan_apex);
-  last_apex_r = apex_r_i;
 }
 
 
-void mirror_x(pixel_t *pixbuf, const int W, const int H) {
+void mirror_x(pixel_t *pixbuf, const int W, const int H, const int pitch) {
   int x, y;
   int x_fold = W >> 1;
   pixel_t *pos_to, *pos_from;
 
   pos_from = pixbuf + x_fold - 1;
   pos_to = pixbuf + W - x_fold;
-  int pitch_to = W - x_fold;
-  int pitch_from = W + x_fold;
+  int pitch_to = pitch - x_fold;
+  int pitch_from = pitch + x_fold;
 
   for (y = 0; y < H; y ++) {
     for (x = 0; x < x_fold; x ++) {
@@ -302,18 +999,18 @@ void mirror_x(pixel_t *pixbuf, const int W, const int H) {
   }
 }
 
-void mirror_y(pixel_t *pixbuf, const int W, const int H) {
-  int x;
+void mirror_y(pixel_t *pixbuf, const int W, const int H, const int pitch) {
+  int x, y;
   int y_fold = H >> 1;
-  pixel_t *pos_to, *pos_from, *end;
-  end = pixbuf + W * H;
+  pixel_t *pos_to, *pos_from;
 
-  pos_from = pixbuf + (y_fold-1) * W;
-  pos_to = pixbuf + (H - y_fold) * W;
+  pos_from = pixbuf + (y_fold-1) * pitch;
+  pos_to = pixbuf + (H - y_fold) * pitch;
 
-  int pitch_from = -2 * W;
+  int pitch_from = -pitch - W;
+  int pitch_to = pitch - W;
 
-  while (pos_to < end) {
+  for (y = 0; y < y_fold; y++) {
     for (x = 0; x < W; x++) {
       pixel_t v = min(*pos_to, *pos_from);
       *pos_to = v;
@@ -322,19 +1019,19 @@ void mirror_y(pixel_t *pixbuf, const int W, const int H) {
       pos_from++;
     }
     pos_from += pitch_from;
+    pos_to += pitch_to;
   }
 }
 
-void mirror_p(pixel_t *pixbuf, const int W, const int H) {
-  int x;
+void mirror_p(pixel_t *pixbuf, const int W, const int H, const int pitch) {
+  int x, y;
   int y_fold = (H >> 1) + (H & 1);
-  pixel_t *pos_to, *pos_from, *end;
-  end = pixbuf + W * H;
+  pixel_t *pos_to, *pos_from;
 
-  pos_from = pixbuf + (y_fold-1) * W + (W - 1);
-  pos_to = pixbuf + (H - y_fold) * W;
+  pos_from = pixbuf + (y_fold-1) * pitch + (W - 1);
+  pos_to = pixbuf + (H - y_fold) * pitch;
 
-  while (pos_to < end) {
+  for (y = 0; y < y_fold; y++) {
     for (x = 0; x < W; x++) {
       pixel_t v = min(*pos_to, *pos_from);
       *pos_to = v;
@@ -342,18 +1039,140 @@ void mirror_p(pixel_t *pixbuf, const int W, const int H) {
       pos_to++;
       pos_from--;
     }
+    pos_from -= pitch - W;
+    pos_to += pitch - W;
   }
 }
 
 #define UNPIXELIZE_BITS 5
 
+/* Everything render() needs to draw one frame. There are two: the compute
+ * side fills in the back frame (the palette is blended right into it) while
+ * the render thread draws the front one, and hand_off_frame() swaps them once
+ * the render thread is done. */
+typedef struct {
+  /* the palette index of each pixel, idx_W * idx_H, written by
+   * wrap_pixbuf(). */
+  uint16_t *idx;
+  palette_t palette;
+  int colorshift;
+  char pixelize;
+  unsigned char invert;
+  /* counts from 0, see frames_calculated. */
+  int number;
+} frame_t;
+
+frame_t frames[2];
+frame_t *front_frame = &frames[0];
+frame_t *back_frame = &frames[1];
+
+/* -Z: clear the rows of pixbuf outside the view, and the parts of the rows
+ * left and right of it. That is only the padding, not the whole buffer. */
+void clear_pad(void) {
+  int y;
+  for (y = 0; y < slab_rows; y++) {
+    int canvas_y = slab_y0 + y;
+    pixel_t *row = pixbuf + y * pitch;
+    if ((canvas_y < view_y) || (canvas_y >= view_y + view_H))
+      bzero(row, W * sizeof(pixel_t));
+    else {
+      bzero(row, view_x * sizeof(pixel_t));
+      bzero(row + view_x + view_W, (W - view_x - view_W) * sizeof(pixel_t));
+    }
+  }
+  // the resident spectrum still has what the last step put there.
+  resident_valid = false;
+}
+
+/* The wrap pass counts the pixels it changed by more than this. Clamping
+ * values below 0.001 to 0 never counts, so that a canvas without wrapping
+ * pixels can stay resident in the frequency domain (see engine_fft_step()). */
+#define WRAP_TOLERANCE 0.001
+
+/* For each row, whether the wrap pass changed it by more than that. */
+bool *wrap_row_changed;
+
+/* Wrap the pixel values of rows [from / W, to / W) of pixbuf into the palette
+ * range (counting the rows of all canvases with -M, one after the other):
+ * values beyond it keep only their fractional part, values below 0.001
+ * become 0. This is part of the simulation, the wrapped values are used for
+ * the next step. Also store each pixel's palette index in the back frame if
+ * *(bool*)arg, i.e. if it will be shown, and note which rows changed by more
+ * than WRAP_TOLERANCE. Written without
+ * branches, and without caring for floating point traps or infinities, so
+ * that it vectorizes. */
+#if defined(__x86_64__) && defined(__GNUC__) && ! defined(__clang__)
+__attribute__((target_clones("avx512f", "avx2", "default")))
+#endif
+__attribute__((optimize("no-trapping-math,finite-math-only")))
+static void wrap_rows(void *arg, int from, int to) {
+  bool shown = *(bool*)arg;
+  int x, y;
+  for (y = from / W; y < to / W; y++) {
+    pixel_t *row = pixbuf + y * pitch;
+    int i = y / H;
+    uint16_t *idx = back_frame->idx
+                    + ((i / wall_cols) * H + (y % H) + slab_y0) * idx_W
+                    + (i % wall_cols) * W;
+    pixel_t change = 0;
+    if (shown) {
+      for (x = 0; x < W; x++) {
+        pixel_t was = row[x];
+        pixel_t frac = was - (int)was;
+        pixel_t v = (was >= PALETTE_LEN)? frac : ((was < 0.001)? 0 : was);
+        row[x] = v;
+        idx[x] = (int)v;
+        change = fmax(change, fabs(was - v));
+      }
+    }
+    else {
+      for (x = 0; x < W; x++) {
+        pixel_t was = row[x];
+        pixel_t frac = was - (int)was;
+        pixel_t v = (was >= PALETTE_LEN)? frac : ((was < 0.001)? 0 : was);
+        row[x] = v;
+        change = fmax(change, fabs(was - v));
+      }
+    }
+    wrap_row_changed[y] = (change > WRAP_TOLERANCE);
+  }
+}
+
+/* Return whether any pixel changed by more than WRAP_TOLERANCE. shown tells
+ * whether the back frame will be drawn; if not (-s), its palette indexes
+ * needn't be stored, nor gathered by the MPI build. */
+bool wrap_pixbuf(bool shown) {
+  int y;
+  workers_run(&workers, wrap_rows, &shown, n_instances * W * slab_rows, W);
+#ifdef BURNSCOPE_MPI
+  if (shown)
+    slab_gather_rows(back_frame->idx, idx_W * sizeof(uint16_t));
+#endif
+  for (y = 0; y < n_instances * slab_rows; y++) {
+    if (wrap_row_changed[y])
+      return true;
+  }
+  return false;
+}
+
+/* -c rgb_direct: black to white, indexed by a channel's value. */
+palette_t rgb_ramp;
+
+/* Draw the view_W x view_H palette indexes at idxbuf, whose rows are idx_W
+ * apart. With -c, these are the red channel, and green and blue follow at
+ * idx_W * H and twice that. */
 void render(Uint32 *winbuf, const int winW, const int winH,
-            palette_t *palette, pixel_t *pixbuf,
+            palette_t *palette, const uint16_t *idxbuf,
             int multiply_pixels, int colorshift, char pixelize,
             unsigned char invert)
 {
-  assert((W * multiply_pixels) == winW);
-  assert((H * multiply_pixels) == winH);
+  assert((view_W * multiply_pixels) == winW);
+  assert((view_H * multiply_pixels) == winH);
+
+  int plane = rgb_mode? idx_W * H : 0;
+  if (rgb_mode == rgb_direct)
+    palette = &rgb_ramp;
+  SDL_PixelFormat *format = palette->format;
 
   int x, y;
   int mx, my;
@@ -363,11 +1182,11 @@ void render(Uint32 *winbuf, const int winW, const int winH,
                                  + (multiply_pixels - 1)*pitch;
 
   Uint32 *winpos = winbuf;
-  pixel_t *pixbufpos = pixbuf;
+  const uint16_t *idxpos = idxbuf;
 
   int pixelize_mask = ~(INT_MAX << pixelize);
-  int pixelize_offset_x = (pixelize_mask - (W & pixelize_mask)) >> 1;
-  int pixelize_offset_y = (pixelize_mask - (H & pixelize_mask)) >> 1;
+  int pixelize_offset_x = (pixelize_mask - (view_W & pixelize_mask)) >> 1;
+  int pixelize_offset_y = (pixelize_mask - (view_H & pixelize_mask)) >> 1;
 
   int invert_mask = INT_MAX;
   invert_mask = ~(invert_mask << UNPIXELIZE_BITS);
@@ -397,41 +1216,39 @@ void render(Uint32 *winbuf, const int winW, const int winH,
 #define AVERAGING 0
 
 #if AVERAGING
-  pixel_t pmin, pmax, psum;
-  pmin = pmax = *pixbufpos;
+  unsigned int pmin, pmax;
+  double psum;
+  pmin = pmax = *idxpos;
   psum = 0;
 #endif
 
-  for (y = 0; y < H; y++) {
-    for (x = 0; x < W; x++, pixbufpos++) {
-      pixel_t pix = *pixbufpos;
-      if (pix >= palette->len) {
-        pix -= palette->len * (int)(pix) / palette->len;
-        *pixbufpos = pix;
-      }
-      else
-      if (pix < 0.001) {
-        pix = 0;
-        //pix += palette->len * (1 + (int)(-pix) / palette->len);
-        *pixbufpos = pix;
-      }
+  for (y = 0; y < view_H; y++) {
+    for (x = 0; x < view_W; x++, idxpos++) {
+      const uint16_t *at = idxpos;
+      unsigned int pix = *at;
 #if AVERAGING
-      if (my == 0) {
-        psum += pix;
-        pmin = min(pmin, pix);
-        pmax = max(pmax, pix);
-      }
+      psum += pix;
+      pmin = min(pmin, pix);
+      pmax = max(pmax, pix);
 #endif
       if (pixelize) {
         int xx = (((x + pixelize_offset_x) & ~pixelize_mask) - pixelize_offset_x) + (pixelize_mask >> 1);
         int yy = (((y + pixelize_offset_y) & ~pixelize_mask) - pixelize_offset_y) + (pixelize_mask >> 1);
-        pix = *(pixbuf + max(0,min(W-1,xx)) + max(0,min(H-1,yy))*W);
+        at = idxbuf + max(0,min(view_W-1,xx)) + max(0,min(view_H-1,yy))*idx_W;
+        pix = *at;
       }
 
-      unsigned int col = (unsigned int)pix + colorshift;
+      unsigned int col = pix + colorshift;
       col %= palette->len;
 
       Uint32 raw = palette->colors[col];
+      if (plane) {
+        unsigned int col_g = (at[plane] + colorshift) % palette->len;
+        unsigned int col_b = (at[2 * plane] + colorshift) % palette->len;
+        raw = (raw & (format->Rmask | format->Amask))
+              | (palette->colors[col_g] & format->Gmask)
+              | (palette->colors[col_b] & format->Bmask);
+      }
 
       if (invert) {
         if ((((x + _invert_offset_x) & invert_mask) <= invert)
@@ -452,18 +1269,19 @@ void render(Uint32 *winbuf, const int winW, const int winH,
       winpos += multiply_pixels;
     }
     winpos += one_multiplied_row_pitch;
+    idxpos += idx_W - view_W;
   }
 
 #if AVERAGING
-  printf("%.3f %.3f %.3f\r", pmin/PALETTE_LEN, pmax/PALETTE_LEN, psum/((float)W*H*PALETTE_LEN));
+  printf("%.3f %.3f %.3f\r", (float)pmin/PALETTE_LEN, (float)pmax/PALETTE_LEN, psum/((float)view_W*view_H*PALETTE_LEN));
   fflush(stdout);
 #endif
 #if 0
   {
     int i, l;
     l = palette->len;
-    if (l > W*H) {
-      l = W*H;
+    if (l > view_W*view_H) {
+      l = view_W*view_H;
     }
     for (i = 0; i < l; i++) {
       ((Uint32*)screen->pixels)[i] = palette->colors[i];
@@ -472,43 +1290,73 @@ void render(Uint32 *winbuf, const int winW, const int winH,
 #endif
 }
 
-void seed1(pixel_t *pixbuf, const int W, const int H, int x, int y,
-           pixel_t val) {
+void seed1(pixel_t *pixbuf, const int W, const int H, const int pitch,
+           int x, int y, pixel_t val) {
   if ((x < 0) || (x >= W) || (y < 0) || (y >= H))
     return;
-  pixbuf[x + y * W] += val;
+  pixbuf[x + y * pitch] += val;
 }
 
-void seed(pixel_t *pixbuf, const int W, const int H, int x, int y,
-          pixel_t val, int apex_r) {
+void seed(pixel_t *pixbuf, const int W, const int H, const int pitch,
+          int x, int y, pixel_t val, int apex_r) {
   int rx, ry;
   for (ry = -apex_r; ry <= apex_r; ry++) {
     for (rx = -apex_r; rx <= apex_r; rx++) {
-      seed1(pixbuf, W, H, x + rx, y + ry, val);
+      seed1(pixbuf, W, H, pitch, x + rx, y + ry, val);
     }
   }
 }
 
-void seed_image(int x, int y, pixel_t *img, int w, int h, pixel_t intensity) {
-  pixel_t *pixbuf_pos = pixbuf + y * W + x;
-  pixel_t *pixbuf_end = pixbuf + W * H;
-  int pixbuf_pitch = max(0, W - w);
+/* -M: each canvas has its own random state for its seeds. */
+unsigned int *instance_random;
+
+/* A random number for seeding canvas i. A single canvas uses random(), so
+ * that recorded sessions play back as before. */
+int random_for(int i) {
+  if (n_instances == 1)
+    return random();
+  return rand_r(&instance_random[i]);
+}
 
+/* Seed around canvas coordinates x, y, as far as it falls into the rows that
+ * pixbuf holds. */
+void seed_canvas(pixel_t *canvas, int x, int y, pixel_t val, int apex_r) {
+  seed(canvas, W, slab_rows, pitch, x, y - slab_y0, val, apex_r);
+}
+
+/* Add an image to the canvas at canvas coordinates x, y, as far as it falls
+ * into the rows that pixbuf holds. */
+void seed_image(pixel_t *canvas, int x, int y, pixel_t *img, int w, int h,
+                pixel_t intensity) {
   pixel_t *img_pos = img;
   int xx, yy;
   for (yy = 0; yy < h; yy++) {
-    for (xx = 0; (xx < w) && (pixbuf_pos < pixbuf_end); xx++) {
+    for (xx = 0; xx < w; xx++, img_pos++) {
+      // image rows running off the right edge continue on the next row.
+      int l = (y + yy) * W + x + xx;
+      if (l < 0)
+        continue;
+      if (l >= W * H)
+        return;
+      int row = (l / W) - slab_y0;
+      if ((row < 0) || (row >= slab_rows))
+        continue;
       pixel_t add = (*img_pos) * 0.42651 * intensity * PALETTE_LEN;
-      (*pixbuf_pos) += add;
-      img_pos ++;
-      pixbuf_pos ++;
+      canvas[row * pitch + (l % W)] += add;
     }
-    pixbuf_pos += pixbuf_pitch;
   }
 }
 
 volatile bool running = true;
+volatile bool rendering = true;
+volatile bool saving = true;
 volatile int frames_rendered = 0;
+/* frames handed to the render thread, i.e. the current position in the
+ * simulation and in recorded parameters. frames_rendered lags behind by up
+ * to one frame. */
+int frames_calculated = 0;
+bool headless = false;
+int max_frames = 0;
 
 volatile int avg_frame_period = 0;
 #define AVG_SHIFTING 3
@@ -519,9 +1367,9 @@ SDL_Renderer *renderer;
 SDL_Texture *texture;
 int winW;
 int winH;
-palette_t palette;
 palette_t blended_palette;
 FILE *out_stream = NULL;
+FILE *out_state = NULL;
 FILE *out_params = NULL;
 FILE *in_params = NULL;
 int in_params_content_start;
@@ -559,10 +1407,27 @@ typedef struct {
   float colorshift_constant;
   float palette_change;
   float min_burn;
+  int kernel;
 } params_t;
 
 const int params_file_id = 0x23315;
-const int params_version = 2;
+const int params_version = 3;
+
+/* -S writes the raw simulation state for each frame, to compare runs e.g. of
+ * the float and double engines, see burnscope_drift.c:
+ * four ints: state_file_id, W, H, sizeof(pixel_t); then per frame W*H
+ * pixel_t values. */
+const int state_file_id = 0x23316;
+
+#ifdef BURNSCOPE_MPI
+/* What rank 0 sends the other ranks each frame, see slab.h. */
+typedef struct {
+  params_t p;
+  bool do_calc;
+  bool running;
+  double use_burn;
+} slab_controls_t;
+#endif
 
 init_params_t ip;
 params_t p = {
@@ -588,27 +1453,645 @@ params_t p = {
   .please_drop_img_y = INT_MAX,
   .seed_intensity = 1,
   .colorshift_constant = 2,
+  .kernel = -1,
 };
 
+/* -M: the parameters each canvas steps with, filled from p by multi_fill(),
+ * and the burn each one uses. */
+params_t *instance_p;
+double *instance_burn;
+
+/* The parameters canvas i steps with. */
+params_t *instance_params(int i) {
+  return (n_instances > 1)? &instance_p[i] : &p;
+}
+
+/* The burn amount that q steps with, at the wavy phase wavy. */
+double burn_of(const params_t *q, float wavy) {
+  double burn = q->burn_amount;
+
+  if (q->do_wavy) {
+    burn += (q->wavy_amp * wavy);
+  }
+
+  if ((q->burn_amount > 0) && (q->apex_r > 10))
+    burn += (q->apex_r - 10) * .0000625;
+  return burn;
+}
+
+/* The -M spread factor of canvas i, from 1 - spread to 1 + spread. */
+double multi_factor(int i) {
+  return 1. + multi_spread * ((2. * i / (n_instances - 1)) - 1.);
+}
+
+/* Give each -M canvas the current controls, with its share of the spread
+ * of the apex radius, burn and seed radius, and with mix, the symmetry mode
+ * and -K kernel i steps after the current ones. Like for the single canvas,
+ * a new kernel or burn makes a symmetric canvas symmetric again. */
+void multi_fill(float wavy) {
+  int i;
+  for (i = 0; i < n_instances; i++) {
+    params_t *q = &instance_p[i];
+    params_t was = *q;
+    double was_burn = instance_burn[i];
+    double f = multi_factor(i);
+
+    *q = p;
+    if ((q->kernel < -1) || (q->kernel >= n_kernels))
+      q->kernel = -1;
+    q->apex_r = fabs(q->apex_r) * f;
+    q->burn_amount *= f;
+    q->seed_r *= f;
+    if (multi_mix) {
+      q->symm = (p.symm + i) % SYMMETRY_KINDS;
+      q->kernel = (q->kernel + 1 + i) % (n_kernels + 1) - 1;
+    }
+    instance_burn[i] = burn_of(q, wavy);
+
+    q->force_symm = was.force_symm
+                    || ((q->symm != symm_none)
+                        && ((q->symm != was.symm) || (q->apex_r != was.apex_r)
+                            || (q->apex_opt != was.apex_opt)
+                            || (q->kernel != was.kernel)
+                            || (instance_burn[i] != was_burn)));
+  }
+}
+
 int normalize_colorshift = 0;
 
 void maximize(void) {
-  pixel_t *pos;
-  pixel_t *end = pixbuf + (W * H);
+  int x, y;
   pixel_t max_val = -1;
-  for (pos = pixbuf; pos < end; pos++) {
-    max_val = max(max_val, *pos);
+  for (y = 0; y < n_instances * slab_rows; y++) {
+    pixel_t *row = pixbuf + y * pitch;
+    for (x = 0; x < W; x++) {
+      max_val = max(max_val, row[x]);
+    }
   }
+#ifdef BURNSCOPE_MPI
+  max_val = slab_max(max_val);
+#endif
   pixel_t diff = (pixel_t)PALETTE_LEN - max_val;
 
-  for (pos = pixbuf; pos < end; pos++) {
-    *pos += diff;
+  for (y = 0; y < n_instances * slab_rows; y++) {
+    pixel_t *row = pixbuf + y * pitch;
+    for (x = 0; x < W; x++) {
+      row[x] += diff;
+    }
   }
 
   normalize_colorshift -= diff;
   printf("normalized %+.2f\n", diff);
 }
 
+/* An engine does one burn step: convolve pixbuf with the apex kernel in
+ * place, and keep up the symmetry mode p.symm. usable() tells whether it can
+ * do so for the current parameters, preferred() (if not NULL) whether it
+ * should be picked automatically when it can. */
+typedef struct {
+  const char *name;
+  bool (*usable)(void);
+  bool (*preferred)(void);
+  void (*step)(void);
+} engine_t;
+
+/* -s: burn steps per drawn frame. The seeds and controls of a frame go into
+ * its first step, and only the last one is drawn. */
+int steps_per_frame = 1;
+
+/* Set when seeds or images were dropped into pixbuf, or it was blanked or
+ * maximized, since the last step, so that the canvas may no longer be
+ * symmetric, nor match the resident spectrum. */
+bool pixbuf_seeded = false;
+
+bool engine_fft_usable(void) {
+  return ! tiled_T;
+}
+
+/* Make the canvas at buf symmetric according to symm. */
+void mirror_symm(pixel_t *buf, symmetry_t symm) {
+#ifdef BURNSCOPE_MPI
+  // rows mirror rows of other slabs.
+  if ((symm == symm_x) || (symm == symm_xy))
+    mirror_x(buf, W, slab_rows, pitch);
+  if ((symm == symm_y) || (symm == symm_xy))
+    slab_mirror(buf, W, H, pitch, false);
+  if (symm == symm_point)
+    slab_mirror(buf, W, H, pitch, true);
+#else
+  if (symm == symm_x)
+    mirror_x(buf, W, H, pitch);
+  else
+  if (symm == symm_xy)
+    mirror_x(buf, W, H, pitch);
+  if ((symm == symm_y) || (symm == symm_xy))
+    mirror_y(buf, W, H, pitch);
+  if (symm == symm_point)
+    mirror_p(buf, W, H, pitch);
+#endif
+}
+
+/* Mirror each canvas whose force_symm is set, or all of them if p's is. */
+void force_symm(void) {
+  int i;
+  for (i = 0; i < n_instances; i++) {
+    params_t *q = instance_params(i);
+    if (p.force_symm || q->force_symm) {
+      q->force_symm = false;
+      mirror_symm(pixbuf + (size_t)i * H * pitch, q->symm);
+    }
+  }
+  p.force_symm = false;
+}
+
+/* When the wrap pass left pixbuf alone, within WRAP_TOLERANCE, its spectrum
+ * is still in resident_f from the previous step, and the forward FFT would
+ * only compute it again. The state then stays in the frequency domain for up
+ * to this many steps in a row. The clamping of tiny values that the resident
+ * spectrum misses can't build up over so few steps. A pending force_symm
+ * (set whenever the burn changes, i.e. every frame with wavy burn) waits for
+ * the next full step, unless the symmetry mode itself changed. */
+#define RESIDENT_MAX_STEPS 8
+
+int resident_steps = 0;
+symmetry_t resident_symm;
+
+void engine_fft_step(void) {
+  FFTW(complex) *spectrum = pixbuf_f;
+  pixel_t g = apex_gain;
+  int half_W = (W / 2) + 1;
+  size_t spectrum_bytes = sizeof(FFTW(complex)) * H * half_W;
+
+  if (resident_valid && (! pixbuf_seeded) && (p.symm == resident_symm)
+      && (resident_steps < RESIDENT_MAX_STEPS)) {
+    spectrum = resident_f;
+    // FFTW's transforms are unnormalized: the forward FFT of what
+    // plan_backward made of resident_f is W * H times resident_f.
+    g *= (pixel_t)W * H;
+    resident_steps ++;
+  }
+  else {
+    force_symm();
+    fft_backend->r2c(plan_forward, pixbuf, pixbuf_f);
+    resident_steps = 0;
+    resident_symm = p.symm;
+  }
+
+  // complex multiplication --> convolution of pixbuf with apex.
+  spectral_job_t job = {
+    spectral->mul, (pixel_t*)spectrum, (pixel_t*)apex_f, g
+  };
+  if (apex_re) {
+    job.func = spectral->mul_real;
+    job.af = apex_re;
+  }
+  // with MPI, the spectrum only has the rows of this rank's slab.
+  job.af += (size_t)slab_y0 * half_W * (apex_re? 1 : 2);
+  workers_run(&workers, spectral_mul_job, &job, slab_rows * half_W, 16);
+
+  if (resident_f) {
+    if (spectrum == resident_f)
+      memcpy(pixbuf_f, resident_f, spectrum_bytes);
+    else
+      memcpy(resident_f, pixbuf_f, spectrum_bytes);
+    resident_valid = true;
+  }
+
+  fft_backend->c2r(plan_backward, pixbuf_f, pixbuf);
+}
+
+/* The dct engine's real to real transforms are FFTW's, it is missing from a
+ * build without FFTW. */
+bool engine_dct_usable(void) {
+#ifdef BURNSCOPE_NO_FFTW
+  return false;
+#else
+  return (! tiled_T)
+         && ((p.symm == symm_x) || (p.symm == symm_y) || (p.symm == symm_xy))
+         && apex_axes_even
+         && dct_fits(p.symm & symm_x, p.symm & symm_y, W, H);
+#endif
+}
+
+void engine_dct_step(void) {
+#ifndef BURNSCOPE_NO_FFTW
+  dct_t *d = &dct[p.symm];
+  if (! d->eig) {
+    dct_init(d, p.symm & symm_x, p.symm & symm_y, W, H, pitch,
+             planner_rigor->flags);
+  }
+  dct_set_kernel(d, apex_re, apex_serial);
+
+  // The canvas outside the fundamental domain is only kept for rendering. It
+  // is only looked at again when something might have broken the symmetry.
+  if (p.force_symm || pixbuf_seeded) {
+    p.force_symm = false;
+    dct_fold(d, pixbuf);
+  }
+  resident_valid = false;
+
+  dct_convolve(d, pixbuf, apex_gain);
+  dct_unfold(d, pixbuf);
+#endif
+}
+
+bool engine_stencil_usable(void) {
+  // its source buffer is another copy of the canvas.
+  return (apex_taps != NULL)
+         && ((! tiled_T)
+             || (((size_t)(W + 2 * STENCIL_MAX_R) * (H + 2 * STENCIL_MAX_R)
+                  * sizeof(pixel_t)) <= ((size_t)mem_budget_mb << 20)));
+}
+
+bool engine_stencil_preferred(void) {
+  return stencil_worth_it(apex_n_taps, W, H);
+}
+
+void engine_stencil_step(void) {
+  if (! stencil.src)
+    stencil_init(&stencil, W, H, pitch);
+  force_symm();
+  resident_valid = false;
+  stencil_convolve(&stencil, &workers, pixbuf, apex_taps, apex_n_taps,
+                   apex_taps_r, apex_gain);
+}
+
+bool engine_multi_usable(void) {
+  return n_instances > 1;
+}
+
+/* Point kernels[i] at the kernel of canvas i: a -K kernel from the kernel
+ * bank, the disc of an earlier canvas with the same one, or its own copy of
+ * its disc from the apex cache, built into it if need be. */
+void multi_kernel(multi_kernel_t *kernels, int i) {
+  const params_t *q = &instance_p[i];
+  multi_kernel_t *k = &kernels[i];
+  int j;
+
+  if (q->kernel >= 0) {
+    apex_cache_entry_t *e = apex_cache_find(&kernel_bank, q->kernel, 0, apex_W,
+                                            apex_H);
+    k->spectrum = e->spectrum;
+    k->real = e->real;
+    return;
+  }
+
+  for (j = 0; j < i; j++) {
+    const params_t *o = &instance_p[j];
+    if ((o->kernel < 0) && (o->apex_r == q->apex_r)
+        && (o->apex_opt == q->apex_opt)) {
+      k->spectrum = kernels[j].spectrum;
+      k->real = kernels[j].real;
+      return;
+    }
+  }
+
+  if ((multi_r[i] != q->apex_r) || (multi_opt[i] != q->apex_opt)) {
+    apex_cache_entry_t *e = apex_cache_find(&apex_cache, q->apex_r,
+                                            q->apex_opt, apex_W, apex_H);
+    if (! e) {
+      e = apex_cache_add(&apex_cache, q->apex_r, q->apex_opt, apex_W, apex_H);
+      build_apex(e->spectrum, apex_W, apex_H, q->apex_r, q->apex_opt);
+      apex_transform(&apex_cache, e);
+    }
+    if (! multi_spectra[i]) {
+      multi_spectra[i] = FFTW(malloc)(apex_cache.complex_bytes);
+      if (! multi_spectra[i]) {
+        printf("No mem.\n");
+        exit(-1);
+      }
+    }
+    memcpy(multi_spectra[i], e->spectrum, e->bytes);
+    multi_real[i] = e->real;
+    multi_r[i] = q->apex_r;
+    multi_opt[i] = q->apex_opt;
+  }
+  k->spectrum = multi_spectra[i];
+  k->real = multi_real[i];
+}
+
+/* All -M canvases at once, each with the kernel, burn and symmetry of its
+ * own parameters. */
+void engine_multi_step(void) {
+  static multi_kernel_t *kernels = NULL;
+  int i;
+
+  if (! kernels) {
+    kernels = malloc_check(n_instances * sizeof(multi_kernel_t));
+    multi_spectra = calloc(n_instances, sizeof(void*));
+    multi_real = malloc_check(n_instances * sizeof(bool));
+    multi_r = malloc_check(n_instances * sizeof(double));
+    multi_opt = malloc_check(n_instances * sizeof(char));
+    if (! multi_spectra) {
+      printf("No mem.\n");
+      exit(-1);
+    }
+    for (i = 0; i < n_instances; i++)
+      multi_r[i] = 0;
+  }
+
+  force_symm();
+  for (i = 0; i < n_instances; i++) {
+    multi_kernel(kernels, i);
+    kernels[i].gain = burn_gain(instance_burn[i]);
+  }
+  multi_step(&multi, &workers, spectral, kernels);
+}
+
+engine_t engine_multi = {
+  "multi", engine_multi_usable, NULL, engine_multi_step
+};
+
+bool engine_regions_usable(void) {
+  return regions.K > 0;
+}
+
+/* -V: one forward FFT of the canvas, then for each -K kernel with a share of
+ * it a spectral multiply and a backward FFT, blended by the masks. */
+void engine_regions_step(void) {
+  int k;
+  int last = -1;
+  bool first = true;
+  int half_W = (W / 2) + 1;
+  size_t spectrum_bytes = sizeof(FFTW(complex)) * H * half_W;
+
+  force_symm();
+  resident_valid = false;
+  fft_backend->r2c(plan_forward, pixbuf, regions.spectrum);
+
+  for (k = 0; k < regions.K; k++) {
+    if (regions.used[k])
+      last = k;
+  }
+
+  for (k = 0; k < regions.K; k++) {
+    if (! regions.used[k])
+      continue;
+    // the last kernel may consume the forward transform itself.
+    FFTW(complex) *spectrum = regions.spectrum;
+    if (k != last) {
+      spectrum = pixbuf_f;
+      memcpy(spectrum, regions.spectrum, spectrum_bytes);
+    }
+
+    apex_cache_entry_t *e = apex_cache_find(&kernel_bank, k, 0, apex_W,
+                                            apex_H);
+    spectral_job_t job = {
+      e->real? spectral->mul_real : spectral->mul,
+      (pixel_t*)spectrum, e->spectrum, apex_gain
+    };
+    workers_run(&workers, spectral_mul_job, &job, H * half_W, 16);
+
+    fft_backend->c2r(plan_backward, spectrum, regions.scratch);
+    regions_add(&regions, &workers, pixbuf, k, first);
+    first = false;
+  }
+}
+
+engine_t engine_regions = {
+  "regions", engine_regions_usable, NULL, engine_regions_step
+};
+
+bool engine_tiled_usable(void) {
+  return tiled_T;
+}
+
+void engine_tiled_step(void) {
+  force_symm();
+  tiled_convolve(&tiled, &workers, spectral, pixbuf,
+                 apex_re? (void*)apex_re : (void*)apex_f, (apex_re != NULL),
+                 apex_gain);
+}
+
+/* In order of preference. The last two are the fallbacks, exactly one of
+ * them is usable. */
+engine_t engines[] = {
+  { "stencil", engine_stencil_usable, engine_stencil_preferred, engine_stencil_step },
+  { "dct", engine_dct_usable, NULL, engine_dct_step },
+  { "tiled", engine_tiled_usable, NULL, engine_tiled_step },
+  { "fft", engine_fft_usable, NULL, engine_fft_step },
+};
+
+#define N_ENGINES (sizeof(engines) / sizeof(engines[0]))
+
+engine_t *fallback_engine(void) {
+  return tiled_T? &engines[N_ENGINES - 2] : &engines[N_ENGINES - 1];
+}
+
+/* -E: use this engine whenever it is usable. NULL means auto: time the
+ * engines, or with engine_guess, pick the first usable and preferred one. */
+engine_t *engine_choice = NULL;
+bool engine_guess = false;
+
+engine_t *guess_engine(void) {
+  int i;
+  for (i = 0; i < N_ENGINES; i++) {
+    engine_t *e = &engines[i];
+    if (e->usable() && ((! e->preferred) || e->preferred()))
+      return e;
+  }
+  return fallback_engine();
+}
+
+/* The engine autotuner times each usable engine for a few steps and picks
+ * the fastest. Its decisions are kept in ~/.cache/burnscope/engines, one
+ * line per CPU model and configuration (see tuner_key()), so that each
+ * configuration is only timed once per machine. The apex radius counts in
+ * whole pixels, so changing apex_r at runtime re-tunes when it crosses an
+ * integer, which is where the kernel support and the number of taps change.
+ *
+ * Single vs. double precision is not a runtime choice (see burnscope_fftf),
+ * it only is part of the key. So is the -X backend, which does the FFTs of
+ * all engines but dct. */
+#define TUNE_STEPS 3
+
+typedef struct {
+  char key[128];
+  engine_t *engine;
+} tuned_t;
+
+tuned_t *tuned = NULL;
+int n_tuned = 0;
+char tuner_path[PATH_MAX + 16] = "";
+char cpu_model[128] = "unknown";
+
+void tuner_key(char *key, size_t len) {
+  if (apex_now_kernel >= 0) {
+    // the whole path may not fit into the key.
+    const char *path = kernel_images[apex_now_kernel].path;
+    const char *name = strrchr(path, '/');
+    snprintf(key, len,
+             PRECISION_NAME " %s %dx%d t%d lean%d symm%d kernel %d %.40s",
+             fft_backend->name, W, H, fft_threads, lean, p.symm,
+             apex_now_kernel, name? name + 1 : path);
+  }
+  else
+    snprintf(key, len, PRECISION_NAME " %s %dx%d t%d lean%d symm%d opt%d r%d",
+             fft_backend->name, W, H, fft_threads, lean, p.symm, apex_now_opt,
+             (int)apex_now_r);
+}
+
+void tuner_add(const char *key, engine_t *e) {
+  tuned = realloc(tuned, (n_tuned + 1) * sizeof(tuned_t));
+  if (! tuned) {
+    printf("No mem.\n");
+    exit(-1);
+  }
+  snprintf(tuned[n_tuned].key, sizeof(tuned[n_tuned].key), "%s", key);
+  tuned[n_tuned].engine = e;
+  n_tuned ++;
+}
+
+/* Read this CPU's model name and the decisions made on it before. */
+void tuner_init(void) {
+  char line[512];
+  FILE *f;
+  int i;
+
+  f = fopen("/proc/cpuinfo", "r");
+  if (f) {
+    while (fgets(line, sizeof(line), f)) {
+      char *colon = strchr(line, ':');
+      if ((strncmp(line, "model name", 10) == 0) && colon) {
+        snprintf(cpu_model, sizeof(cpu_model), "%s", colon + 2);
+        cpu_model[strcspn(cpu_model, "\t\n")] = 0;
+        break;
+      }
+    }
+    fclose(f);
+  }
+
+  const char *dir = cache_dir();
+  if (! dir)
+    return;
+  snprintf(tuner_path, sizeof(tuner_path), "%s/engines", dir);
+
+  // lines of "cpu model<TAB>key<TAB>engine name"
+  f = fopen(tuner_path, "r");
+  if (! f)
+    return;
+  while (fgets(line, sizeof(line), f)) {
+    char *key = strchr(line, '\t');
+    char *name = key? strchr(key + 1, '\t') : NULL;
+    if (! name)
+      continue;
+    *key++ = 0;
+    *name++ = 0;
+    name[strcspn(name, "\n")] = 0;
+    if (strcmp(line, cpu_model))
+      continue;
+    for (i = 0; i < N_ENGINES; i++) {
+      if (strcmp(name, engines[i].name) == 0)
+        tuner_add(key, &engines[i]);
+    }
+  }
+  fclose(f);
+}
+
+double time_engine(engine_t *e) {
+  int i;
+  Uint64 best = 0;
+  Uint64 freq = SDL_GetPerformanceFrequency();
+
+  // the first step may plan or allocate.
+  e->step();
+
+  for (i = 0; i < TUNE_STEPS; i++) {
+    // nothing wraps between these steps, so the fft engine would keep
+    // skipping its forward FFT; time full steps like the others.
+    resident_valid = false;
+    resident_steps = 0;
+    Uint64 start = SDL_GetPerformanceCounter();
+    e->step();
+    Uint64 elapsed = SDL_GetPerformanceCounter() - start;
+    if ((i == 0) || (elapsed < best))
+      best = elapsed;
+  }
+  return 1000. * best / freq;
+}
+
+/* Time all usable engines on a copy of the current state, which is put back
+ * afterwards. */
+engine_t *tune_engine(const char *key) {
+  int i;
+  engine_t *fastest = fallback_engine();
+  double fastest_ms = 0;
+  pixel_t *saved = malloc_check(pixbuf_bytes);
+  bool saved_force_symm = p.force_symm;
+  bool saved_seeded = pixbuf_seeded;
+
+  memcpy(saved, pixbuf, pixbuf_bytes);
+
+  printf("tuning engines for %s:", key);
+  for (i = 0; i < N_ENGINES; i++) {
+    engine_t *e = &engines[i];
+    if (! e->usable())
+      continue;
+    double ms = time_engine(e);
+    printf(" %s %.2fms", e->name, ms);
+    if ((fastest_ms == 0) || (ms < fastest_ms)) {
+      fastest = e;
+      fastest_ms = ms;
+    }
+    memcpy(pixbuf, saved, pixbuf_bytes);
+    p.force_symm = saved_force_symm;
+    pixbuf_seeded = saved_seeded;
+    resident_valid = false;
+  }
+  printf(" --> %s\n", fastest->name);
+
+  free(saved);
+  return fastest;
+}
+
+engine_t *tuned_engine(void) {
+  static char last_key[128] = "";
+  static engine_t *last = NULL;
+  char key[128];
+  int i;
+
+  tuner_key(key, sizeof(key));
+  if (last && (strcmp(key, last_key) == 0))
+    return last;
+
+  last = NULL;
+  for (i = 0; i < n_tuned; i++) {
+    if (strcmp(key, tuned[i].key) == 0)
+      last = tuned[i].engine;
+  }
+
+  if (! last) {
+    last = tune_engine(key);
+    tuner_add(key, last);
+    if (*tuner_path) {
+      FILE *f = fopen(tuner_path, "a");
+      if (f) {
+        fprintf(f, "%s\t%s\t%s\n", cpu_model, key, last->name);
+        fclose(f);
+      }
+    }
+  }
+
+  strcpy(last_key, key);
+  return last;
+}
+
+engine_t *pick_engine(void) {
+  engine_t *e;
+  if (engine_regions.usable())
+    return &engine_regions;
+  if (engine_multi.usable())
+    return &engine_multi;
+  if (engine_choice)
+    e = engine_choice;
+  else
+  if (engine_guess || tiled_T) // timing would copy the large canvas.
+    e = guess_engine();
+  else
+    e = tuned_engine();
+  return e->usable()? e : fallback_engine();
+}
+
 
 SDL_sem *please_render;
 SDL_sem *please_save;
@@ -617,13 +2100,13 @@ SDL_sem *saving_done;
 
 int render_thread(void *arg) {
 
-  float want_frame_period = (want_fps > .1? 1000. / want_fps : 0);
+  float want_frame_period = (want_fps > .1 && ! headless? 1000. / want_fps : 0);
   float last_ticks = (float)SDL_GetTicks() - want_frame_period;
 
   for (;;) {
 
     SDL_SemWait(please_render);
-    if (! running)
+    if (! rendering)
       break;
 
     while (want_frame_period) {
@@ -639,13 +2122,18 @@ int render_thread(void *arg) {
       SDL_SemWait(saving_done);
     }
 
-    render(winbuf, winW, winH, &palette, pixbuf, multiply_pixels, colorshift, p.pixelize, p.invert);
+    frame_t *f = front_frame;
+    render(winbuf, winW, winH, &f->palette,
+           f->idx + view_y * idx_W + view_x, multiply_pixels,
+           f->colorshift, f->pixelize, f->invert);
 
-    SDL_UpdateTexture(texture, NULL, winbuf, winW * sizeof(Uint32));
+    if (! headless) {
+      SDL_UpdateTexture(texture, NULL, winbuf, winW * sizeof(Uint32));
 
-    SDL_RenderClear(renderer);
-    SDL_RenderCopy(renderer, texture, NULL, NULL);
-    SDL_RenderPresent(renderer);
+      SDL_RenderClear(renderer);
+      SDL_RenderCopy(renderer, texture, NULL, NULL);
+      SDL_RenderPresent(renderer);
+    }
 
     int t = SDL_GetTicks();
 
@@ -653,7 +2141,7 @@ int render_thread(void *arg) {
       SDL_SemPost(please_save);
     }
 
-    frames_rendered ++;
+    frames_rendered = f->number + 1;
     SDL_SemPost(rendering_done);
 
     {
@@ -669,11 +2157,25 @@ int render_thread(void *arg) {
   return 0;
 }
 
+/* Call once the render thread is done with the front frame, i.e. after
+ * taking rendering_done: complete the back frame and have it drawn, while
+ * the compute side goes on with the next step in the other frame. */
+void hand_off_frame(void) {
+  frame_t *f = back_frame;
+  f->colorshift = colorshift;
+  f->pixelize = p.pixelize;
+  f->invert = p.invert;
+  f->number = frames_calculated ++;
+  back_frame = front_frame;
+  front_frame = f;
+  SDL_SemPost(please_render);
+}
+
 int save_thread(void *arg) {
 
   for (;;) {
     SDL_SemWait(please_save);
-    if (! running)
+    if (! saving)
       break;
 
     if (out_stream) {
@@ -694,6 +2196,11 @@ volatile int audio_too = 0;
 char *audio_path = NULL;
 bool audio_sync_verbose = true;
 
+void headless_stop(int sig) {
+  printf("Signal %d. Stop.\n", sig);
+  running = false;
+}
+
 void audio_play_callback(void *userdata, Uint8 *stream, int len) {
   bool smoothen = false;
   static int audio_bytes_played = 0;
@@ -757,48 +2264,205 @@ int main(int argc, char *argv[])
   int c;
 
   char *out_stream_path = NULL;
+  bool default_wisdom = true;
+  bool probe_threads = false;
+  bool fft_friendly = false;
+  char *out_state_path = NULL;
   char *out_params_path = NULL;
   char *in_params_path = NULL;
 
   ip.random_seed = time(NULL);
   ip.start_blank = false;
 
-  int divide_pixels = 1;
+  int divide_pixels = 1;
+
+  bool recording_parameters = false;
+
+#ifdef BURNSCOPE_MPI
+  slab_init(&argc, &argv);
+  slab_root = (slab_layout.rank == 0);
+#endif
+
+  while (1) {
+    c = getopt(argc, argv, "bha:c:d:e:f:g:m:n:p:r:s:t:u:i:o:w:B:C:E:K:M:O:P:S:V:X:Z:FGHLT");
+    if (c == -1)
+      break;
+
+    switch (c) {
+      case 'g':
+        {
+          char arg[strlen(optarg) + 1];
+          strcpy(arg, optarg);
+          char *ch = arg;
+          while ((*ch) && ((*ch) != 'x')) ch ++;
+          if ((*ch) == 'x') {
+            *ch = 0;
+            ch ++;
+            W = atoi(arg);
+            H = atoi(ch);
+
+          }
+          else {
+            fprintf(stderr, "Invalid -g argument: '%s'\n", optarg);
+            exit(-1);
+          }
+        }
+        break;
+
+      case 'd':
+        divide_pixels = atoi(optarg);
+        break;
+
+      case 'F':
+        fullscreen = true;
+        break;
+
+      case 'G':
+        fft_friendly = true;
+        break;
+
+      case 'Z':
+        zero_pad = atoi(optarg);
+        if (zero_pad < 1) {
+          fprintf(stderr, "Invalid -Z argument: '%s'\n", optarg);
+          exit(-1);
+        }
+        break;
+
+      case 'H':
+        headless = true;
+        break;
+
+      case 'n':
+        max_frames = atoi(optarg);
+        break;
+
+      case 's':
+        steps_per_frame = atoi(optarg);
+        if (steps_per_frame < 1) {
+          fprintf(stderr, "Invalid -s argument: '%s'\n", optarg);
+          exit(-1);
+        }
+        break;
+
+      case 'C':
+        apex_cache_mb = atoi(optarg);
+        break;
+
+      case 'B':
+        mem_budget_mb = max(0, atoi(optarg));
+        break;
+
+      case 'L':
+        lean = true;
+        break;
+
+      case 'M':
+        n_instances = max(1, atoi(optarg));
+        if (strchr(optarg, ',')) {
+          char *mix = strchr(strchr(optarg, ',') + 1, ',');
+          multi_spread = atof(strchr(optarg, ',') + 1);
+          if (mix) {
+            if (strcmp(mix + 1, "mix")) {
+              fprintf(stderr, "-M %s: expected N,spread,mix\n", optarg);
+              exit(1);
+            }
+            multi_mix = true;
+          }
+        }
+        if ((multi_spread < 0) || (multi_spread >= 1)) {
+          fprintf(stderr, "-M %s: the spread must be at least 0 and below 1\n",
+                  optarg);
+          exit(1);
+        }
+        break;
+
+      case 'K':
+        kernels_dir = optarg;
+        break;
+
+      case 'V':
+        regions_dir = optarg;
+        break;
 
-  bool recording_parameters = false;
+      case 'c':
+        if (strcmp(optarg, "direct") == 0)
+          rgb_mode = rgb_direct;
+        else
+        if (strcmp(optarg, "palette") == 0)
+          rgb_mode = rgb_palette;
+        else {
+          fprintf(stderr, "Invalid -c argument: '%s'\n", optarg);
+          exit(-1);
+        }
+        break;
 
-  while (1) {
-    c = getopt(argc, argv, "bha:d:f:g:m:p:r:u:i:o:O:P:F");
-    if (c == -1)
-      break;
+      case 'e':
+        {
+          int i;
+          planner_rigor = NULL;
+          for (i = 0; i < PLANNER_RIGORS; i++) {
+            if (strcmp(optarg, planner_rigors[i].name) == 0)
+              planner_rigor = &planner_rigors[i];
+          }
+          if (! planner_rigor) {
+            fprintf(stderr, "Invalid -e argument: '%s'\n", optarg);
+            exit(-1);
+          }
+        }
+        break;
 
-    switch (c) {
-      case 'g':
+      case 'X':
         {
-          char arg[strlen(optarg) + 1];
-          strcpy(arg, optarg);
-          char *ch = arg;
-          while ((*ch) && ((*ch) != 'x')) ch ++;
-          if ((*ch) == 'x') {
-            *ch = 0;
-            ch ++;
-            W = atoi(arg);
-            H = atoi(ch);
+          int i;
+          fft_backend = NULL;
+          for (i = 0; i < N_FFT_BACKENDS; i++) {
+            if (strcmp(optarg, fft_backends[i]->name) == 0)
+              fft_backend = fft_backends[i];
+          }
+          if (! fft_backend) {
+            fprintf(stderr, "Invalid -X argument: '%s'\n", optarg);
+            exit(-1);
+          }
+        }
+        break;
 
+      case 'E':
+        {
+          int i;
+          engine_choice = NULL;
+          for (i = 0; i < N_ENGINES; i++) {
+            if (strcmp(optarg, engines[i].name) == 0)
+              engine_choice = &engines[i];
           }
-          else {
-            fprintf(stderr, "Invalid -g argument: '%s'\n", optarg);
+          engine_guess = (strcmp(optarg, "guess") == 0);
+          if ((! engine_choice) && (! engine_guess) && strcmp(optarg, "auto")) {
+            fprintf(stderr, "Invalid -E argument: '%s'\n", optarg);
             exit(-1);
           }
         }
         break;
 
-      case 'd':
-        divide_pixels = atoi(optarg);
+      case 't':
+        if (strcmp(optarg, "auto") == 0)
+          fft_threads = 0;
+        else {
+          fft_threads = atoi(optarg);
+          if (fft_threads < 1) {
+            fprintf(stderr, "Invalid -t argument: '%s'\n", optarg);
+            exit(-1);
+          }
+        }
         break;
 
-      case 'F':
-        fullscreen = true;
+      case 'T':
+        probe_threads = true;
+        break;
+
+      case 'w':
+        default_wisdom = false;
+        if (strcmp(optarg, "none"))
+          wisdom_path = optarg;
         break;
 
       case 'm':
@@ -825,6 +2489,10 @@ int main(int argc, char *argv[])
         out_stream_path = optarg;
         break;
 
+      case 'S':
+        out_state_path = optarg;
+        break;
+
       case 'o':
         out_params_path = optarg;
         recording_parameters = true;
@@ -872,7 +2540,20 @@ int main(int argc, char *argv[])
 "\n"
 "  -g WxH   Set animation width and height in number of pixels.\n"
 "           Default is '-g %dx%d'.\n"
+"  -G       Simulate on the next larger size whose factors are only 2, 3, 5\n"
+"           and 7, which FFTW transforms fastest, and show the middle of it\n"
+"           at the -g size. Prints the speedup measured at startup.\n"
+"  -Z R     Assume zeros around the borders, instead of wrapping around them,\n"
+"           for apex radii of up to R: simulate on an FFT friendly size with\n"
+"           at least R pixels of padding, which is cleared before each step.\n"
 "  -F       Start in full-screen mode.\n"
+"  -H       Headless: no window, no joysticks and no frame rate limit, just\n"
+"           calculate and write frames as fast as possible. Use with -O and\n"
+"           -i to render a recorded session to a video file.\n"
+"  -n N     Stop after N frames.\n"
+"  -s N     Burn N steps per frame, and draw only the last one, to reach\n"
+"           mature patterns sooner, or fast forward with -H. Recorded\n"
+"           parameters (-o) play back the same only with the same -s.\n"
 "  -f fps   Set desired framerate to <fps> frames per second. The framerate\n"
 "           may slew if your system cannot calculate fast enough.\n"
 "           If zero, run as fast as possible. Default is %.1f.\n"
@@ -882,26 +2563,84 @@ int main(int argc, char *argv[])
 "  -a W     Set apex radius, i.e. the blur distance. Default is %.3f.\n"
 "  -u N.n   Set underdampening factor (decimal). Default is %.3f.\n"
 "           Reduces normal blur dampening by this factor.\n"
+"  -C MiB   Memory limit for cached apex spectra, so that switching between\n"
+"           recently used apex radii and options is instant. Default is %d.\n"
+"  -K dir   Load kernels from the PNG and raw float (*.f32, square) files in\n"
+"           dir, centred on their middle pixel. Keys x and z (or joystick\n"
+"           button 9) switch to the next and previous one, c back to the disc.\n"
+"  -V dir   Burn with all -K kernels at once, each weighted across the\n"
+"           canvas by a mask image from dir, one per kernel in the same\n"
+"           (alphabetical) order. Not with -L, -M, -c or tiles.\n"
+"  -L       Memory-lean mode: transform the simulation state in place, using\n"
+"           about half the memory for large canvases.\n"
+"  -M N[,spread[,mix]]\n"
+"           Run N independent canvases of the -g size side by side, as a\n"
+"           wall of tiles, each with its own parameters and random seeds,\n"
+"           all transformed in one batch. The controls set the parameters\n"
+"           of all of them. With a spread, e.g. 0.5, their apex radii, burns\n"
+"           and seed radii range from 1 - spread to 1 + spread times the\n"
+"           current ones. With mix, canvas i also has the symmetry mode and\n"
+"           -K kernel i steps after the current ones.\n"
+"  -c mode  Colour: run three canvases as the red, green and blue channels,\n"
+"           each with its own random seeds, all transformed in one batch.\n"
+"           'direct' shows each channel's value as its brightness, 'palette'\n"
+"           takes each channel's part of the palette colour of its value.\n"
+"  -B MiB   Memory budget for the FFT buffers besides the canvas itself. If\n"
+"           the spectra of the whole canvas don't fit, convolve it in tiles\n"
+"           instead (overlap-save, engine 'tiled'); the apex radius is then\n"
+"           limited to an eighth of the tile size. This also allows canvases\n"
+"           beyond %d pixels, up to %d. Default is no limit, or %d for\n"
+"           such large canvases.\n"
+"  -t N     Number of FFT threads, or 'auto' (default): the CPUs this process\n"
+"           may use (affinity and cgroup quota), minus one for the render\n"
+"           thread and one for the save thread (with -O).\n"
+"  -T       Probe the FFT speed per number of threads at startup. Without\n"
+"           -t N, use the fastest.\n"
+"  -E name  Engine: 'stencil', 'dct', 'fft', 'tiled', 'guess' or 'auto'\n"
+"           (default).\n"
+"           stencil convolves directly, for kernels of up to %d pixels radius.\n"
+"           dct simulates only a half or a quarter of the canvas in the\n"
+"           mirrored symmetry modes; it needs an even width and/or height and\n"
+"           a kernel symmetric along each axis. Both fall back to fft, or to\n"
+"           tiled when -B calls for it.\n"
+"           auto times the engines for each configuration and apex radius\n"
+"           and remembers the fastest in ~/.cache/burnscope/engines. guess\n"
+"           uses stencil for kernels with few taps, else dct, else fft.\n"
+"  -e rigor FFTW planner rigor: estimate, measure, patient or exhaustive.\n"
+"           More rigor takes longer to start, but may calculate faster.\n"
+"           Default is '%s'.\n"
+"  -w file  Load and save FFTW wisdom (plans) from/to this file, or 'none'.\n"
+"           Default is a file in ~/.cache/burnscope/ per size, threads and\n"
+"           precision, so planning with -e is done once per machine.\n"
+"  -X name  FFT backend of all engines but dct: 'fftw' (default) or\n"
+"           'builtin', which needs sizes whose factors are only 2, 3, 5\n"
+"           and 7 (see -G). -T and -G time the chosen backend. Builds\n"
+"           without FFTW (burnscope_fft_nofftw) only have 'builtin'.\n"
 "  -b       Start out blank.\n"
 "  -r seed  Supply a random seed to start off with.\n"
 "  -O file  Write raw video data to file (grows large quickly). Can be\n"
 "           converted to a video file using e.g. ffmpeg.\n"
+"  -S file  Write the raw simulation state of each frame to file, to compare\n"
+"           runs with burnscope_drift (grows even larger).\n"
 "  -o file  Write live control parameters to file for later playback, see -i.\n"
 "  -i file  Play back previous control parameters (possibly in a different\n"
 "           resolution and streaming video to file...)\n"
 "  -p file  Play back audio file in sync with actual framerate.\n"
 "           The file format should match your sound card output format\n"
 "           exactly.\n"
-, W, H, want_fps, p.apex_r, p.burn_amount
+, W, H, want_fps, p.apex_r, p.burn_amount, apex_cache_mb,
+  MAX_PIXELS, TILED_MAX_PIXELS, TILED_DEFAULT_BUDGET_MB,
+  STENCIL_MAX_R, planner_rigor->name
 );
+#ifdef BURNSCOPE_MPI
+    slab_finish();
+#endif
     if (error)
       return 1;
     return 0;
   }
 
-  const int maxpixels = 1e4;
-
-  if ((W < 3) || (W > maxpixels) || (H < 3) || (H > maxpixels)) {
+  if ((W < 3) || (W > TILED_MAX_PIXELS) || (H < 3) || (H > TILED_MAX_PIXELS)) {
     fprintf(stderr, "width and/or height out of bounds: %dx%d\n", W, H);
     exit(1);
   }
@@ -909,6 +2648,63 @@ int main(int argc, char *argv[])
   min_W_H = min(W, H);
   max_W_H = max(W, H);
 
+  if (rgb_mode) {
+    if (n_instances > 1) {
+      fprintf(stderr, "-c cannot be combined with -M\n");
+      exit(1);
+    }
+    n_instances = 3;
+  }
+
+  if (n_instances > 1) {
+    if (lean || (divide_pixels > 1) || fft_friendly || zero_pad) {
+      fprintf(stderr, "-M and -c cannot be combined with -L, -d, -G or -Z\n");
+      exit(1);
+    }
+    wall_cols = rgb_mode? 1 : ceil(sqrt(n_instances));
+    wall_rows = (n_instances + wall_cols - 1) / wall_cols;
+  }
+  view_W = W * wall_cols;
+  view_H = rgb_mode? H : H * wall_rows;
+
+#ifdef BURNSCOPE_MPI
+  // the slabs are transformed in place with the fft engine, the other engines
+  // need the whole canvas.
+  // -G would time the sizes on each rank, which may then pick different ones.
+  if ((n_instances > 1) || mem_budget_mb || (fft_backend != &fftw_backend)
+      || regions_dir || fft_friendly) {
+    fprintf(stderr, "-M, -c, -B, -X, -V and -G are not available with MPI\n");
+    exit(1);
+  }
+  lean = true;
+  engine_choice = &engines[N_ENGINES - 1];
+  engine_guess = false;
+  if (! slab_root) {
+    // rank 0 does all input and output, except for writing -S.
+    headless = true;
+    recording_parameters = false;
+    out_stream_path = NULL;
+    out_params_path = NULL;
+    in_params_path = NULL;
+    audio_path = NULL;
+  }
+#endif
+
+  if (probe_threads && fft_threads) {
+    probe_fft_threads(fft_threads);
+  }
+  else
+  if (probe_threads) {
+    fft_threads = probe_fft_threads(usable_cpus());
+  }
+  else
+  if (! fft_threads) {
+    fft_threads = auto_fft_threads(out_stream_path != NULL);
+  }
+
+  if ((! engine_choice) && (! engine_guess) && (n_instances == 1))
+    tuner_init();
+
   {
     double was_apex_r = p.apex_r;
     p.apex_r = min(max_W_H, p.apex_r);
@@ -924,8 +2720,8 @@ int main(int argc, char *argv[])
     exit(1);
   }
 
-  winW = W;
-  winH = H;
+  winW = view_W;
+  winH = view_H;
 
   if (multiply_pixels > 1) {
     winW *= multiply_pixels;
@@ -941,16 +2737,147 @@ int main(int argc, char *argv[])
       exit(1);
     }
     multiply_pixels = divide_pixels;
-    W = winW / multiply_pixels;
-    H = winH / multiply_pixels;
+    W = view_W = winW / multiply_pixels;
+    H = view_H = winH / multiply_pixels;
+  }
+
+  if (zero_pad) {
+    int padded_W = zero_padded_size(W, zero_pad);
+    int padded_H = zero_padded_size(H, zero_pad);
+    if ((padded_W > TILED_MAX_PIXELS) || (padded_H > TILED_MAX_PIXELS)) {
+      fprintf(stderr, "-Z %d: the padded canvas %dx%d is too large\n",
+              zero_pad, padded_W, padded_H);
+      exit(1);
+    }
+    printf("zero borders: simulating %dx%d, apex radius up to %d\n",
+           padded_W, padded_H, zero_pad);
+    view_x = (padded_W - W) / 2;
+    view_y = (padded_H - H) / 2;
+    W = padded_W;
+    H = padded_H;
+  }
+
+  {
+    size_t spectrum_bytes = sizeof(FFTW(complex)) * H * ((W / 2) + 1);
+    // pixbuf_f and resident_f, or the -M spectra (and their kernels with a
+    // spread), and the apex spectrum.
+    size_t fft_bytes = spectrum_bytes
+                       * (lean? 1
+                          : (n_instances > 1)
+                            ? n_instances * (multi_spread? 2 : 1) + 1
+                          : 3);
+    size_t budget = (size_t)mem_budget_mb << 20;
+
+    if ((W > MAX_PIXELS) || (H > MAX_PIXELS)
+        || (mem_budget_mb && (fft_bytes > budget))) {
+      if (lean || (n_instances > 1)) {
+        fprintf(stderr, "-L and -M need a canvas of at most %dx%d whose"
+                " spectra fit into the -B budget\n", MAX_PIXELS, MAX_PIXELS);
+        exit(1);
+      }
+      if (! mem_budget_mb)
+        mem_budget_mb = TILED_DEFAULT_BUDGET_MB;
+      tiled_T = tiled_pick_size(W, H, fft_threads,
+                                (size_t)mem_budget_mb << 20);
+      if (! tiled_T) {
+        fprintf(stderr, "-B %d: no tiles of at least %dx%d fit into the"
+                " canvas and the budget\n", mem_budget_mb, TILED_MIN_T,
+                TILED_MIN_T);
+        exit(1);
+      }
+      printf("tiles of %dx%d, apex radius up to %d\n", tiled_T, tiled_T,
+             tiled_T / TILED_HALO_DIV);
+    }
+  }
+
+  if (fft_friendly && tiled_T) {
+    printf("-G: the tiles are FFT friendly already\n");
+  }
+  else
+  if (fft_friendly) {
+    int friendly_W = fft_friendly_size(W);
+    int friendly_H = fft_friendly_size(H);
+    if ((friendly_W == W) && (friendly_H == H))
+      printf("-G: %dx%d is FFT friendly already\n", W, H);
+    else
+    if (! fft_backend->fits(W, H)) {
+      printf("-G: %s FFTs need %dx%d\n", fft_backend->name, friendly_W,
+             friendly_H);
+      view_x = (friendly_W - W) / 2;
+      view_y = (friendly_H - H) / 2;
+      W = friendly_W;
+      H = friendly_H;
+    }
+    else {
+      // without the wisdom of earlier starts, -e would plan both sizes
+      // again each time. What they teach FFTW is saved at exit.
+#ifndef BURNSCOPE_NO_FFTW
+      if (fft_backend == &fftw_backend) {
+        if (default_wisdom) {
+          import_wisdom(default_wisdom_path(W, H));
+          import_wisdom(default_wisdom_path(friendly_W, friendly_H));
+        }
+        else
+          import_wisdom(wisdom_path);
+      }
+#endif
+      double ms = fft_frame_ms(W, H, fft_threads, planner_rigor->flags);
+      double friendly_ms = fft_frame_ms(friendly_W, friendly_H, fft_threads,
+                                        planner_rigor->flags);
+      printf("-G: FFTs of %dx%d take %.3f ms, of %dx%d %.3f ms: %.2fx\n",
+             W, H, ms, friendly_W, friendly_H, friendly_ms, ms / friendly_ms);
+      if (friendly_ms < ms) {
+        // show the middle of the larger canvas.
+        view_x = (friendly_W - W) / 2;
+        view_y = (friendly_H - H) / 2;
+        W = friendly_W;
+        H = friendly_H;
+      }
+      else
+        printf("-G: keeping %dx%d\n", W, H);
+    }
+  }
+  idx_W = W * wall_cols;
+  idx_H = H * wall_rows;
+
+  {
+    // the kernels are transformed at the size of the canvas or of a tile.
+    int fft_W = tiled_T? tiled_T : W;
+    int fft_H = tiled_T? tiled_T : H;
+    if (! fft_backend->fits(fft_W, fft_H)) {
+      fprintf(stderr, "-X %s: cannot transform %dx%d, try -G\n",
+              fft_backend->name, fft_W, fft_H);
+      exit(1);
+    }
+  }
+
+  if (regions_dir
+      && ((! kernels_dir) || lean || (n_instances > 1) || tiled_T)) {
+    fprintf(stderr, "-V needs -K, and cannot be combined with -L, -M, -c or"
+            " a tiled canvas\n");
+    exit(1);
   }
 
+  if (default_wisdom)
+    wisdom_path = default_wisdom_path(W, H);
+#ifdef BURNSCOPE_NO_FFTW
+  // there is no FFTW to plan.
+  wisdom_path = NULL;
+#endif
+
+  const int maxpixels = tiled_T? TILED_MAX_PIXELS : MAX_PIXELS;
+
   if ( (winW > maxpixels) || (winH > maxpixels) ) {
     fprintf(stderr, "pixel multiplication is too large: %dx%d times %d = %dx%d\n",
             W, H, multiply_pixels, winW, winH);
     exit(1);
   }
 
+  if (headless && audio_path) {
+    fprintf(stderr, "-p: cannot play audio in headless mode (-H)\n");
+    exit(1);
+  }
+
   if (out_stream_path) {
     if (access(out_stream_path, F_OK) == 0) {
       fprintf(stderr, "file exists, will not overwrite: %s\n", out_stream_path);
@@ -960,6 +2887,20 @@ int main(int argc, char *argv[])
     audio_sync_verbose = false;
   }
 
+  if (out_state_path && slab_root) {
+    if (access(out_state_path, F_OK) == 0) {
+      fprintf(stderr, "file exists, will not overwrite: %s\n", out_state_path);
+      exit(1);
+    }
+    out_state = fopen(out_state_path, "w");
+    if (! out_state) {
+      fprintf(stderr, "Cannot open state file: %s\n", out_state_path);
+      exit(1);
+    }
+    int hdr[4] = { state_file_id, W, n_instances * H, sizeof(pixel_t) };
+    fwrite(hdr, sizeof(hdr), 1, out_state);
+  }
+
   if (out_params_path) {
     if (access(out_params_path, F_OK) == 0) {
       fprintf(stderr, "file exists, will not overwrite: %s\n", out_params_path);
@@ -972,7 +2913,7 @@ int main(int argc, char *argv[])
     in_params = fopen(in_params_path, "r");
   }
 
-  printf("burnscope: %dx%d  -->  video: %dx%d\n", W, H, winW, winH);
+  printf("burnscope: %dx%d (" PRECISION_NAME ")  -->  video: %dx%d\n", W, H, winW, winH);
 
   int in_params_framelen = sizeof(p);
   int in_params_read_framelen = 0;
@@ -1020,6 +2961,10 @@ int main(int argc, char *argv[])
     printf("in_params start @%d\n", in_params_content_start);
   }
 
+#ifdef BURNSCOPE_MPI
+  // all ranks seed the same spots, each in its own slab.
+  slab_share(&ip, sizeof(ip));
+#endif
   printf("random seed: %d\n", ip.random_seed);
   srandom(ip.random_seed);
 
@@ -1046,7 +2991,8 @@ int main(int argc, char *argv[])
   read_images("./images", &images, &n_images, W, H);
 
 
-  if ( SDL_Init(SDL_INIT_VIDEO | SDL_INIT_TIMER | SDL_INIT_JOYSTICK
+  if ( SDL_Init(SDL_INIT_TIMER
+                | (headless? 0 : SDL_INIT_VIDEO | SDL_INIT_JOYSTICK)
                 | (audio_path? SDL_INIT_AUDIO : 0))
        < 0 )
   {
@@ -1054,36 +3000,46 @@ int main(int argc, char *argv[])
     exit(1);
   }
 
-  SDL_Window *window;
-  window = SDL_CreateWindow("burnscope_fft", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED,
-                            winW, winH, 0);
+  SDL_Window *window = NULL;
+  SDL_PixelFormat *pixelformat = SDL_AllocFormat(SDL_PIXELFORMAT_RGBA8888);
 
-  if (!window) {
-    fprintf(stderr, "Unable to set %dx%d video: %s\n", winW, winH, SDL_GetError());
-    exit(1);
+  if (headless) {
+    printf("headless\n");
+    // the other MPI ranks stop when rank 0 tells them to.
+    signal(SIGINT, slab_root? headless_stop : SIG_IGN);
+    signal(SIGTERM, slab_root? headless_stop : SIG_IGN);
   }
+  else {
+    window = SDL_CreateWindow("burnscope_fft", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED,
+                              winW, winH, 0);
 
-  if (fullscreen)
-    SDL_SetWindowFullscreen(window, SDL_WINDOW_FULLSCREEN);
+    if (!window) {
+      fprintf(stderr, "Unable to set %dx%d video: %s\n", winW, winH, SDL_GetError());
+      exit(1);
+    }
 
-  renderer = SDL_CreateRenderer(window, -1, 0);
-  if (!renderer) {
-    fprintf(stderr, "Unable to set %dx%d video: %s\n", winW, winH, SDL_GetError());
-    exit(1);
-  }
+    if (fullscreen)
+      SDL_SetWindowFullscreen(window, SDL_WINDOW_FULLSCREEN);
 
-  SDL_ShowCursor(SDL_DISABLE);
-  SDL_PixelFormat *pixelformat = SDL_AllocFormat(SDL_PIXELFORMAT_RGBA8888);
-  texture = SDL_CreateTexture(renderer, pixelformat->format,
-                              SDL_TEXTUREACCESS_STREAMING, winW, winH);
-  if (!texture) {
-    fprintf(stderr, "Cannot create texture\n");
-    exit(1);
+    renderer = SDL_CreateRenderer(window, -1, 0);
+    if (!renderer) {
+      fprintf(stderr, "Unable to set %dx%d video: %s\n", winW, winH, SDL_GetError());
+      exit(1);
+    }
+
+    SDL_ShowCursor(SDL_DISABLE);
+    texture = SDL_CreateTexture(renderer, pixelformat->format,
+                                SDL_TEXTUREACCESS_STREAMING, winW, winH);
+    if (!texture) {
+      fprintf(stderr, "Cannot create texture\n");
+      exit(1);
+    }
   }
 
-  const int n_joysticks = SDL_NumJoysticks();
+  const int n_joysticks = headless? 0 : SDL_NumJoysticks();
 
-  printf("%d joysticks were found.\n", n_joysticks);
+  if (! headless)
+    printf("%d joysticks were found.\n", n_joysticks);
 
   SDL_Joystick **joysticks = NULL;
 
@@ -1109,7 +3065,10 @@ int main(int argc, char *argv[])
   }
 
   make_palettes(pixelformat);
-  make_palette(&palette, PALETTE_LEN,
+  make_palette(&frames[0].palette, PALETTE_LEN,
+               palette_defs[0],
+               pixelformat);
+  make_palette(&frames[1].palette, PALETTE_LEN,
                palette_defs[0],
                pixelformat);
 
@@ -1117,17 +3076,64 @@ int main(int argc, char *argv[])
                palette_defs[0],
                pixelformat);
 
+  if (rgb_mode == rgb_direct) {
+    static palette_def_t ramp = { 0 };
+    make_palette(&rgb_ramp, PALETTE_LEN, &ramp, pixelformat);
+  }
+
   fft_init();
+  if (kernels_dir)
+    load_kernels();
+
+  if (regions_dir) {
+    image_t *masks;
+    int n_masks;
+    printf("kernel masks in %s:\n", regions_dir);
+    read_images(regions_dir, &masks, &n_masks, view_W, view_H);
+    if ((! n_kernels) || (n_masks != n_kernels)) {
+      fprintf(stderr, "-V: %d masks for %d -K kernels\n", n_masks,
+              n_kernels);
+      exit(1);
+    }
+    regions_init(&regions, n_kernels, masks, W, H, pitch, view_x, view_y,
+                 view_W, view_H);
+  }
 
   winbuf = malloc_check(winW * winH * sizeof(Uint32));
+  // tiles of the wall without a canvas stay blank.
+  frames[0].idx = calloc(idx_W * idx_H, sizeof(uint16_t));
+  frames[1].idx = calloc(idx_W * idx_H, sizeof(uint16_t));
+  if ((! frames[0].idx) || (! frames[1].idx)) {
+    printf("No mem.\n");
+    exit(-1);
+  }
+  wrap_row_changed = malloc_check(n_instances * H * sizeof(bool));
+
+  if (n_instances > 1) {
+    int i;
+    instance_random = malloc_check(n_instances * sizeof(unsigned int));
+    instance_p = calloc(n_instances, sizeof(params_t));
+    instance_burn = calloc(n_instances, sizeof(double));
+    if ((! instance_p) || (! instance_burn)) {
+      printf("No mem.\n");
+      exit(-1);
+    }
+    for (i = 0; i < n_instances; i++)
+      instance_random[i] = ip.random_seed + i;
+    multi_fill(0);
+  }
 
   if (! ip.start_blank) {
-    int i, j;
-    j = 2*p.apex_r + 1;
-    j *= j;
-    j = W * H / j;
-    for (i = 0; i < j; i ++) {
-      seed(pixbuf, W, H, random() % (W), random() % (H), SEED_VAL, p.apex_r);
+    int i, j, k;
+    for (k = 0; k < n_instances; k++) {
+      pixel_t *canvas = pixbuf + (size_t)k * H * pitch;
+      float apex_r = instance_params(k)->apex_r;
+      j = 2*apex_r + 1;
+      j *= j;
+      j = W * H / j;
+      for (i = 0; i < j; i ++) {
+        seed_canvas(canvas, random_for(k) % (W), random_for(k) % (H), SEED_VAL, apex_r);
+      }
     }
   }
   else {
@@ -1138,18 +3144,18 @@ int main(int argc, char *argv[])
   bool do_print = true;
   float wavy_speed = .5;
   double use_burn = 1.002;
+  engine_t *engine = fallback_engine();
 
   please_render = SDL_CreateSemaphore(0);
   please_save = SDL_CreateSemaphore(0);
-  rendering_done = SDL_CreateSemaphore(0);
+  // the render thread starts out idle, ready for the first frame.
+  rendering_done = SDL_CreateSemaphore(1);
   saving_done = SDL_CreateSemaphore(1);
 
   SDL_Thread *render_thread_token = SDL_CreateThread(render_thread, NULL, "render");
   SDL_Thread *save_thread_token = NULL;
   if (out_stream)
-    SDL_CreateThread(save_thread, NULL, "save");
-
-  fftw_execute(plan_forward);
+    save_thread_token = SDL_CreateThread(save_thread, NULL, "save");
 
   if (audio_path) {
     SF_INFO audio_sndfile_info;
@@ -1213,19 +3219,29 @@ int main(int argc, char *argv[])
   int had_outparams = 0;
   int img_seeding = -1;
   int img_seeding_slew = 0;
+#ifdef BURNSCOPE_MPI
+  // whether the other ranks have been told to stop.
+  bool controls_stopped = false;
+#endif
 
   while (running)
   {
+    if (max_frames && (frames_calculated >= max_frames)) {
+      printf("Rendered %d frames. Stop.\n", frames_calculated);
+      running = false;
+      break;
+    }
+
 #define BACK_SPEED 4
 #define BACK_SEEK (BACK_SPEED + 1)
-    if (do_back && (frames_rendered > (BACK_SEEK+1))) {
+    if (do_back && (frames_calculated > (BACK_SEEK+1))) {
       if (in_params) {
         fseek(in_params, -BACK_SEEK * in_params_framelen, SEEK_CUR);
       }
       if (out_params) {
         fseek(out_params, -BACK_SEEK * sizeof(p), SEEK_CUR);
       }
-      frames_rendered -= BACK_SEEK;
+      frames_calculated -= BACK_SEEK;
     }
 
     if (in_params || out_params) {
@@ -1278,6 +3294,8 @@ int main(int argc, char *argv[])
           check_param(seed_intensity);
           check_param(colorshift_constant);
           check_param(palette_change);
+          check_param(min_burn);
+          check_param(kernel);
 
           #undef check_param
         }
@@ -1295,7 +3313,7 @@ int main(int argc, char *argv[])
       if (read_in_params_to) {
         bool do_read_in_params = true;
 
-        if (out_params && (had_outparams > frames_rendered)) {
+        if (out_params && (had_outparams > frames_calculated)) {
           // user has previously played these params and recorded them to the
           // out_params file, and has possibly recorded new parameters in the
           // process. Read those that were written earlier.
@@ -1352,6 +3370,8 @@ int main(int argc, char *argv[])
         check_param(seed_intensity);
         check_param(colorshift_constant);
         check_param(palette_change);
+        check_param(min_burn);
+        check_param(kernel);
 
         #undef check_param
 
@@ -1387,14 +3407,60 @@ int main(int argc, char *argv[])
 
     }
 
+    if (img_seeding >= 0) {
+      if (img_seeding_slew) {
+        img_seeding_slew --;
+      }
+      else {
+        int _img_seeding = img_seeding;
+        if (_img_seeding >= 10) {
+          _img_seeding -= 10;
+          if (_img_seeding < n_images) {
+            p.please_drop_img_x = -images[_img_seeding].width / 2;
+            p.please_drop_img_y = -images[_img_seeding].height / 2;
+          }
+        }
+        p.please_drop_img = _img_seeding;
+        img_seeding_slew = 0; // 2
+      }
+    }
+
+
+    if (do_calc) {
+      float t = (float)frames_calculated / 100.;
+      wavy = sin(wavy_speed*t);
+
+      use_burn = burn_of(&p, wavy);
+      if (n_instances > 1)
+        multi_fill(wavy);
+    }
+
+#ifdef BURNSCOPE_MPI
+    {
+      // the other ranks follow rank 0's controls.
+      slab_controls_t c = { p, do_calc, running, use_burn };
+      slab_share(&c, sizeof(c));
+      p = c.p;
+      do_calc = c.do_calc;
+      running = c.running;
+      use_burn = c.use_burn;
+      if (! running) {
+        controls_stopped = true;
+        break;
+      }
+    }
+#endif
+
     if (p.do_maximize) {
       //p.do_maximize = false; first save below
       maximize();
+      pixbuf_seeded = true;
     }
 
     if (p.do_blank) {
       // p.do_blank = false; first save below
-      bzero(pixbuf, W * H * sizeof(pixel_t));
+      bzero(pixbuf, pixbuf_bytes);
+      pixbuf_seeded = true;
     }
 
     colorshift = normalize_colorshift;
@@ -1430,45 +3496,13 @@ int main(int argc, char *argv[])
       palette_t *left_pal = &palettes[left_pal_idx % n_palettes];
       palette_t *right_pal = &palettes[right_pal_idx % n_palettes];
 
-      blend_palettes(&palette, left_pal, right_pal, palette_blend_position);
-    }
-
-    if (img_seeding >= 0) {
-      if (img_seeding_slew) {
-        img_seeding_slew --;
-      }
-      else {
-        int _img_seeding = img_seeding;
-        if (_img_seeding >= 10) {
-          _img_seeding -= 10;
-          if (_img_seeding < n_images) {
-            p.please_drop_img_x = -images[_img_seeding].width / 2;
-            p.please_drop_img_y = -images[_img_seeding].height / 2;
-          }
-        }
-        p.please_drop_img = _img_seeding;
-        img_seeding_slew = 0; // 2
-      }
-    }
-
-
-    if (do_calc) {
-      float t = (float)frames_rendered / 100.;
-      wavy = sin(wavy_speed*t);
-
-      use_burn = p.burn_amount;
-
-      if (p.do_wavy) {
-        use_burn += (p.wavy_amp * wavy);
-      }
-
-      if ((p.burn_amount > 0) && (p.apex_r > 10))
-        use_burn += (p.apex_r - 10) * .0000625;
+      blend_palettes(&back_frame->palette, left_pal, right_pal,
+                     palette_blend_position);
     }
 
     if (out_params) {
       fwrite(&p, sizeof(p), 1, out_params);
-      had_outparams = max(had_outparams, frames_rendered);
+      had_outparams = max(had_outparams, frames_calculated);
     }
 
     // clear those values that were handled above but still needed to be
@@ -1483,48 +3517,62 @@ int main(int argc, char *argv[])
     }
 
     if (do_calc) {
-      p.n_seed = max(0, min(100, p.n_seed));
-      while (running && p.n_seed) {
-        p.n_seed --;
-        int seedx = random() % W;
-        int seedy = random() % H;
-        seed(pixbuf, W, H, seedx, seedy, SEED_VAL, p.seed_r);
-
-        if ((p.symm == symm_x) || (p.symm == symm_xy))
-          // seedx = 0 ==> seedx = W -1
-          seed(pixbuf, W, H, W-1 - seedx, seedy, SEED_VAL, p.seed_r);
-
-        if ((p.symm == symm_y) || (p.symm == symm_xy))
-          seed(pixbuf, W, H, seedx, H-1 - seedy, SEED_VAL, p.seed_r);
-        if (p.symm == symm_point)
-          seed(pixbuf, W, H, W-1 - seedx, H-1 - seedy, SEED_VAL, p.seed_r);
+      int i;
+      for (i = 0; running && (i < n_instances); i++) {
+        pixel_t *canvas = pixbuf + (size_t)i * H * pitch;
+        params_t *q = instance_params(i);
+        q->n_seed = max(0, min(100, q->n_seed));
+        while (q->n_seed) {
+          q->n_seed --;
+          int seedx = random_for(i) % W;
+          int seedy = random_for(i) % H;
+          seed_canvas(canvas, seedx, seedy, SEED_VAL, q->seed_r);
+          pixbuf_seeded = true;
+
+          if ((q->symm == symm_x) || (q->symm == symm_xy))
+            // seedx = 0 ==> seedx = W -1
+            seed_canvas(canvas, W-1 - seedx, seedy, SEED_VAL, q->seed_r);
+
+          if ((q->symm == symm_y) || (q->symm == symm_xy))
+            seed_canvas(canvas, seedx, H-1 - seedy, SEED_VAL, q->seed_r);
+          if (q->symm == symm_point)
+            seed_canvas(canvas, W-1 - seedx, H-1 - seedy, SEED_VAL, q->seed_r);
+        }
       }
+      p.n_seed = 0;
 
       if (p.please_drop_img >= 0) {
         if (p.please_drop_img < n_images) {
           int W2 = W >> 1;
           int H2 = H >> 1;
           image_t *img = &images[p.please_drop_img];
-
-          if (p.please_drop_img_x == INT_MAX)
-            p.please_drop_img_x = random() % (30 + W - img->width);
-          else
-            p.please_drop_img_x += W2;
-
-          if (p.please_drop_img_y == INT_MAX)
-            p.please_drop_img_y = random() % (30 + H - img->height);
-          else
-            p.please_drop_img_y += H2;
+          int x = 0;
+          int y = 0;
 
           float intensity = p.seed_intensity;
           intensity = .001 + .1 * intensity * intensity;
+
+          pixbuf_seeded = true;
+          // the images are grey, so -c drops them into all three channels at
+          // the same place; each -M canvas gets one at a place of its own.
+          for (i = 0; i < n_instances; i++) {
+            if ((i == 0) || (! rgb_mode)) {
+              if (p.please_drop_img_x == INT_MAX)
+                x = random_for(i) % (30 + W - img->width);
+              else
+                x = p.please_drop_img_x + W2;
+
+              if (p.please_drop_img_y == INT_MAX)
+                y = random_for(i) % (30 + H - img->height);
+              else
+                y = p.please_drop_img_y + H2;
+            }
 #if 0
-          printf("img x%d y%d %d %f\n", p.please_drop_img_x, p.please_drop_img_y,
-                 p.please_drop_img, intensity);
+            printf("img x%d y%d %d %f\n", x, y, p.please_drop_img, intensity);
 #endif
-
-          seed_image(p.please_drop_img_x, p.please_drop_img_y, img->data, img->width, img->height,
-                     1.);
+            seed_image(pixbuf + (size_t)i * H * pitch, x, y, img->data,
+                       img->width, img->height, 1.);
+          }
         }
         p.please_drop_img = -1;
         p.please_drop_img_x = INT_MAX;
@@ -1532,60 +3580,76 @@ int main(int argc, char *argv[])
       }
 
 
-      {
-        if (p.force_symm) {
-          p.force_symm = false;
-          if (p.symm == symm_x)
-            mirror_x(pixbuf, W, H);
-          else
-          if (p.symm == symm_xy)
-            mirror_x(pixbuf, W, H);
-          if ((p.symm == symm_y) || (p.symm == symm_xy))
-            mirror_y(pixbuf, W, H);
-          if (p.symm == symm_point)
-            mirror_p(pixbuf, W, H);
+      int step;
+      for (step = 0; step < steps_per_frame; step++) {
+        if (step) {
+          // the wrap pass of a step that is not drawn.
+          if (wrap_pixbuf(false))
+            resident_valid = false;
         }
+        if (zero_pad)
+          clear_pad();
+        engine = pick_engine();
+        engine->step();
+        pixbuf_seeded = false;
       }
+    }
 
-      int x;
-      int half_W = (W / 2) + 1;
-      fftw_execute(plan_forward);
-
-      // complex multiplication --> convolution of pixbuf with apex.
-      for (x = 0; x < H*half_W; x++) {
-        pixel_t *pf = pixbuf_f[x];
-        pixel_t *af = apex_f[x];
-        pixel_t a, b, c, d;
-        a = pf[0]; b = pf[1];
-        c = af[0]; d = af[1];
-        pf[0] = (a*c - b*d);
-        pf[1] = (b*c + a*d);
-      }
-
-      fftw_execute(plan_backward);
-
+#ifdef BURNSCOPE_MPI
+    if (out_state_path)
+      slab_write_rows(out_state, pixbuf, W, pitch);
+#else
+    if (out_state) {
+      int y;
+      for (y = 0; y < n_instances * H; y++)
+        fwrite(pixbuf + y * pitch, sizeof(pixel_t), W, out_state);
     }
+#endif
 
-    SDL_SemPost(please_render);
+    if (wrap_pixbuf(true))
+      resident_valid = false;
 
     {
       static double was_apex_r = 0;
       static double was_burn = 0;
       static char was_apex_opt = 0;
+      static int was_kernel = -1;
 
       p.apex_r = fabs(p.apex_r);
+      if ((p.kernel < -1) || (p.kernel >= n_kernels))
+        p.kernel = -1;
 
-      if ((was_apex_r != p.apex_r) || (was_burn != use_burn) || (was_apex_opt != p.apex_opt)) {
-        make_apex(p.apex_r, use_burn, p.apex_opt);
+      bool new_disc = (was_apex_r != p.apex_r) || (was_apex_opt != p.apex_opt);
+
+      if (was_kernel != p.kernel) {
+        if (p.kernel >= 0)
+          use_kernel(p.kernel);
+        else
+          make_apex(p.apex_r, p.apex_opt);
+      }
+      else
+      if (new_disc && (p.kernel < 0))
+        make_apex(p.apex_r, p.apex_opt);
+
+      if (new_disc || (was_burn != use_burn) || (was_kernel != p.kernel)) {
+        // only the kernel's shape needs a new FFT, the burn is just a factor.
+        apex_gain = burn_gain(use_burn);
+        apex_burn = use_burn;
         was_apex_r = p.apex_r;
         was_burn = use_burn;
         was_apex_opt = p.apex_opt;
+        was_kernel = p.kernel;
 
         if (p.symm != symm_none)
           p.force_symm = true;
       }
     }
 
+#ifdef BURNSCOPE_MPI
+    if (! slab_root)
+      continue;
+#endif
+
     static char printcount = 0;
     if (printcount++ >= 10) {
       if (printcount >= 50)
@@ -1594,17 +3658,31 @@ int main(int argc, char *argv[])
       if (do_print) {
         do_print = false;
         printcount = 0;
-        printf("%.1ffps apex_r=%f_opt%d burn=%f(%f) audio_sync=%d\n",
+        printf("%.1ffps apex_r=%f_opt%d burn=%f(%f) audio_sync=%d apex_cache=%d/%d engine=%s\n",
                1000./(avg_frame_period>>AVG_SHIFTING),
                p.apex_r,p.apex_opt,
                use_burn,
                p.burn_amount,
-               audio_too);
+               audio_too,
+               apex_cache.hits, apex_cache.misses, engine->name);
         audio_too = 0;
         fflush(stdout);
       }
     }
 
+    if (headless) {
+      // no events to poll, no frame rate to keep. Just wait for the previous
+      // frame to be rendered, hand over this one and go on calculating the
+      // next one.
+      while (running) {
+        if (SDL_SemWaitTimeout(rendering_done, 100) == 0) {
+          hand_off_frame();
+          break;
+        }
+      }
+      continue;
+    }
+
     while (running) {
       SDL_Event event;
       while (SDL_PollEvent(&event))
@@ -1726,6 +3804,19 @@ int main(int argc, char *argv[])
                   p.apex_opt = 4;
                   break;
 
+                case 'x':
+                  // the next -K kernel, after the last one the disc.
+                  p.kernel = (p.kernel + 2) % (n_kernels + 1) - 1;
+                  break;
+
+                case 'z':
+                  p.kernel = (p.kernel + n_kernels + 1) % (n_kernels + 1) - 1;
+                  break;
+
+                case 'c':
+                  p.kernel = -1;
+                  break;
+
                 case 'l':
                   wavy_speed += .5;
                   break;
@@ -1967,6 +4058,10 @@ int main(int argc, char *argv[])
                   do_rerecord_params_overlay = false;
                   break;
 
+                case 9:
+                  p.kernel = (p.kernel + 2) % (n_kernels + 1) - 1;
+                  break;
+
                 default:
                   printf("%2d: button %d = %s\n",
                          event.jbutton.which, event.jbutton.button,
@@ -2022,8 +4117,10 @@ int main(int argc, char *argv[])
 
       } // while sdl poll event
 
-      if (SDL_SemTryWait(rendering_done) == 0)
+      if (SDL_SemTryWait(rendering_done) == 0) {
+        hand_off_frame();
         break;
+      }
       else
         SDL_Delay(5);
     } // while running, for event polling / idle waiting
@@ -2034,16 +4131,25 @@ int main(int argc, char *argv[])
     printf("Main loop exited. Stop.\n");
   running = false;
 
-  SDL_SemPost(please_render);
-  SDL_SemPost(please_render);
-  if (out_stream) {
-    SDL_SemPost(please_save);
-    SDL_SemPost(please_save);
+#ifdef BURNSCOPE_MPI
+  if (! controls_stopped) {
+    slab_controls_t c = { p, false, false, 0 };
+    slab_share(&c, sizeof(c));
   }
+#endif
+
   printf("waiting for render thread...\n");
+  // let the last frame handed off be rendered before stopping the thread.
+  SDL_SemWait(rendering_done);
+  rendering = false;
+  SDL_SemPost(please_render);
   SDL_WaitThread(render_thread_token, NULL);
   if (out_stream) {
     printf("waiting for save thread...\n");
+    // let the last rendered frame hit the disk before stopping the thread.
+    SDL_SemWait(saving_done);
+    saving = false;
+    SDL_SemPost(please_save);
     SDL_WaitThread(save_thread_token, NULL);
   }
 
@@ -2075,6 +4181,10 @@ int main(int argc, char *argv[])
       printf("-i %s -acodec ac3 ", audio_path);
     printf("-vcodec mpeg4 -q 1 %s.%d.mp4\n", out_stream_path, winH);
   }
+  if (out_state) {
+    fclose(out_state);
+    out_state = NULL;
+  }
   if (out_params) {
     if (in_params) {
       printf("Copying remaining parameters stream from in to out: %s --> %s\n",
@@ -2113,6 +4223,9 @@ int main(int argc, char *argv[])
   }
   fft_destroy();
   SDL_Quit();
+#ifdef BURNSCOPE_MPI
+  slab_finish();
+#endif
   return 0;
 }
 
@@ -0,0 +1,173 @@
+/* Convolution of a mirror symmetric canvas, computed on its fundamental
+ * domain only. A canvas that is mirrored about its vertical centre line,
+ * p[x] == p[W-1-x], is periodic with period W and even about x = -1/2 and
+ * x = W/2 - 1/2. Its left half is all there is to know, and the DCT-II
+ * (FFTW_REDFT10) of the left half has the same coefficients as the full FFT.
+ * Convolving with a kernel that is even along x then means multiplying each
+ * DCT coefficient by the kernel's (real) spectrum, and transforming back with
+ * a DCT-III (FFTW_REDFT01). An axis that is not mirrored stays periodic and
+ * is transformed with FFTW_R2HC / FFTW_HC2R.
+ *
+ * That needs an even number of pixels along each mirrored axis, and a kernel
+ * that is even along each axis on its own, apex[-x,y] == apex[x,-y] ==
+ * apex[x,y]. For symm_x, symm_y and symm_xy, this transforms a half or a
+ * quarter of the canvas instead of all of it. (Point symmetry has no such
+ * rectangular fundamental domain.)
+ *
+ * Both transform pairs scale by the number of points along the full period,
+ * 2 * W/2 or W, so the kernel normalization of the full FFT applies as is. */
+
+typedef struct {
+  bool mirror_x;
+  bool mirror_y;
+  int W;
+  int H;
+  int pitch;
+  /* the fundamental domain, the top left nW x nH pixels. */
+  int nW;
+  int nH;
+  FFTW(plan) forward;
+  FFTW(plan) backward;
+  /* kernel spectrum for each coefficient, nW * nH. */
+  pixel_t *eig;
+  unsigned int eig_serial;
+} dct_t;
+
+bool dct_fits(bool mirror_x, bool mirror_y, int W, int H) {
+  return (mirror_x || mirror_y)
+         && ((! mirror_x) || ((W & 1) == 0))
+         && ((! mirror_y) || ((H & 1) == 0));
+}
+
+/* Plan for a W x H canvas with rows of pitch pixel_t. Planning happens on a
+ * scratch buffer (it may scribble on the array); the plans are executed on
+ * the actual canvas, which must be FFTW(malloc)ed as well. */
+void dct_init(dct_t *d, bool mirror_x, bool mirror_y, int W, int H, int pitch,
+              unsigned int planner_flags) {
+  bzero(d, sizeof(*d));
+  d->mirror_x = mirror_x;
+  d->mirror_y = mirror_y;
+  d->W = W;
+  d->H = H;
+  d->pitch = pitch;
+  d->nW = mirror_x? W / 2 : W;
+  d->nH = mirror_y? H / 2 : H;
+  d->eig = malloc_check(d->nW * d->nH * sizeof(pixel_t));
+  d->eig_serial = 0;
+
+  int n[2] = { d->nH, d->nW };
+  int embed[2] = { H, pitch };
+  FFTW(r2r_kind) fw_kind[2] = {
+    mirror_y? FFTW_REDFT10 : FFTW_R2HC,
+    mirror_x? FFTW_REDFT10 : FFTW_R2HC
+  };
+  FFTW(r2r_kind) bw_kind[2] = {
+    mirror_y? FFTW_REDFT01 : FFTW_HC2R,
+    mirror_x? FFTW_REDFT01 : FFTW_HC2R
+  };
+
+  pixel_t *scratch = FFTW(malloc)(H * pitch * sizeof(pixel_t));
+  if (! scratch) {
+    printf("No mem.\n");
+    exit(-1);
+  }
+  d->forward = FFTW(plan_many_r2r)(2, n, 1, scratch, embed, 1, 0,
+                                   scratch, embed, 1, 0,
+                                   fw_kind, planner_flags);
+  d->backward = FFTW(plan_many_r2r)(2, n, 1, scratch, embed, 1, 0,
+                                    scratch, embed, 1, 0,
+                                    bw_kind, planner_flags);
+  FFTW(free)(scratch);
+}
+
+void dct_destroy(dct_t *d) {
+  if (d->forward)
+    FFTW(destroy_plan)(d->forward);
+  if (d->backward)
+    FFTW(destroy_plan)(d->backward);
+  free(d->eig);
+  bzero(d, sizeof(*d));
+}
+
+/* Frequency index of coefficient i along an axis of n points: DCT
+ * coefficients are in order, halfcomplex arrays hold r0, r1, ..., r(n/2),
+ * i((n+1)/2-1), ..., i1, and both parts of a frequency get the same real
+ * factor. */
+static int dct_freq(bool mirror, int n, int i) {
+  if (mirror || (i <= (n / 2)))
+    return i;
+  return n - i;
+}
+
+/* Take the kernel spectrum from the real-only r2c spectrum of the full
+ * canvas (H rows of W/2+1). serial tells whether it is still the same. */
+void dct_set_kernel(dct_t *d, const pixel_t *spectrum_re, unsigned int serial) {
+  int x, y;
+  int half_W = (d->W / 2) + 1;
+
+  if (d->eig_serial == serial)
+    return;
+
+  for (y = 0; y < d->nH; y++) {
+    int ky = dct_freq(d->mirror_y, d->H, y);
+    for (x = 0; x < d->nW; x++) {
+      int kx = dct_freq(d->mirror_x, d->W, x);
+      d->eig[y * d->nW + x] = spectrum_re[ky * half_W + kx];
+    }
+  }
+  d->eig_serial = serial;
+}
+
+/* Make the fundamental domain the minimum of all its mirror images, like
+ * mirror_x() and mirror_y() do for the whole canvas. */
+void dct_fold(dct_t *d, pixel_t *buf) {
+  int x, y;
+  if (d->mirror_x) {
+    for (y = 0; y < d->H; y++) {
+      pixel_t *row = buf + y * d->pitch;
+      for (x = 0; x < d->nW; x++)
+        row[x] = min(row[x], row[d->W - 1 - x]);
+    }
+  }
+  if (d->mirror_y) {
+    for (y = 0; y < d->nH; y++) {
+      pixel_t *row = buf + y * d->pitch;
+      pixel_t *mrow = buf + (d->H - 1 - y) * d->pitch;
+      for (x = 0; x < d->nW; x++)
+        row[x] = min(row[x], mrow[x]);
+    }
+  }
+}
+
+/* Copy the fundamental domain to the rest of the canvas. */
+void dct_unfold(dct_t *d, pixel_t *buf) {
+  int x, y;
+  if (d->mirror_x) {
+    for (y = 0; y < d->nH; y++) {
+      pixel_t *row = buf + y * d->pitch;
+      for (x = 0; x < d->nW; x++)
+        row[d->W - 1 - x] = row[x];
+    }
+  }
+  if (d->mirror_y) {
+    for (y = 0; y < d->nH; y++)
+      memcpy(buf + (d->H - 1 - y) * d->pitch, buf + y * d->pitch,
+             d->W * sizeof(pixel_t));
+  }
+}
+
+/* Convolve the fundamental domain in place, with the kernel scaled by g. */
+void dct_convolve(dct_t *d, pixel_t *buf, pixel_t g) {
+  int x, y;
+
+  FFTW(execute_r2r)(d->forward, buf, buf);
+
+  for (y = 0; y < d->nH; y++) {
+    pixel_t *row = buf + y * d->pitch;
+    const pixel_t *eig = d->eig + y * d->nW;
+    for (x = 0; x < d->nW; x++)
+      row[x] *= eig[x] * g;
+  }
+
+  FFTW(execute_r2r)(d->backward, buf, buf);
+}
@@ -0,0 +1,143 @@
+/* The FFTs of the whole canvas (the fft engine, -M and -c), of the tiles of
+ * the tiled engine and of the apex kernels go through an FFT backend,
+ * selected with -X: FFTW, or the builtin one (see builtin_fft.h). Only the
+ * dct engine uses FFTW directly, so a build without FFTW (BURNSCOPE_NO_FFTW)
+ * has the builtin backend and all engines but that one. Both backends do the
+ * same unnormalized H x W real to H x (W/2+1) complex transform and back,
+ * with FFTW's layout and sign, so that spectra from either one can be used
+ * with the other engines. Like FFTW's, a plan is made for a pair of buffers,
+ * and can be executed on other buffers of the same alignment and
+ * in-placeness; the complex to real direction destroys its input. */
+
+typedef struct fft_plan fft_plan_t;
+
+typedef struct {
+  const char *name;
+  /* whether the backend can transform a W x H canvas at all. */
+  bool (*fits)(int W, int H);
+  /* the number of threads for plans made from now on. */
+  void (*threads)(int n);
+  void (*cleanup)(void);
+  void *(*malloc)(size_t bytes);
+  void (*free)(void *p);
+  /* in == out transforms in place, with rows padded to 2 * (W/2 + 1). */
+  fft_plan_t *(*plan_r2c)(int H, int W, pixel_t *in, FFTW(complex) *out,
+                          unsigned flags);
+  fft_plan_t *(*plan_c2r)(int H, int W, FFTW(complex) *in, pixel_t *out,
+                          unsigned flags);
+  /* n canvases one after the other, out of place: H rows of W pixel_t each,
+   * and H * (W/2 + 1) complex each. */
+  fft_plan_t *(*plan_many_r2c)(int n, int H, int W, pixel_t *in,
+                               FFTW(complex) *out, unsigned flags);
+  fft_plan_t *(*plan_many_c2r)(int n, int H, int W, FFTW(complex) *in,
+                               pixel_t *out, unsigned flags);
+  void (*r2c)(fft_plan_t *plan, pixel_t *in, FFTW(complex) *out);
+  void (*c2r)(fft_plan_t *plan, FFTW(complex) *in, pixel_t *out);
+  void (*destroy)(fft_plan_t *plan);
+} fft_backend_t;
+
+#ifndef BURNSCOPE_NO_FFTW
+
+/* FFTW's new-array execute functions don't work on every kind of plan (e.g.
+ * MPI plans), so plans remember their buffers and use FFTW(execute) on them. */
+typedef struct {
+  FFTW(plan) plan;
+  void *in;
+  void *out;
+} fftw_backend_plan_t;
+
+/* Wrap a plan that FFTW made for in and out. */
+fft_plan_t *fftw_backend_wrap(FFTW(plan) plan, void *in, void *out) {
+  fftw_backend_plan_t *f = malloc_check(sizeof(*f));
+  f->plan = plan;
+  f->in = in;
+  f->out = out;
+  return (fft_plan_t*)f;
+}
+
+static bool fftw_backend_fits(int W, int H) {
+  return true;
+}
+
+static void fftw_backend_threads(int n) {
+  FFTW(init_threads)();
+  FFTW(plan_with_nthreads)(n);
+}
+
+static void fftw_backend_cleanup(void) {
+  // fft_destroy() cleans up FFTW, which the other engines use, too.
+}
+
+static void *fftw_backend_malloc(size_t bytes) {
+  return FFTW(malloc)(bytes);
+}
+
+static void fftw_backend_free(void *p) {
+  FFTW(free)(p);
+}
+
+static fft_plan_t *fftw_backend_plan_r2c(int H, int W, pixel_t *in,
+                                         FFTW(complex) *out, unsigned flags) {
+  return fftw_backend_wrap(FFTW(plan_dft_r2c_2d)(H, W, in, out, flags),
+                           in, out);
+}
+
+static fft_plan_t *fftw_backend_plan_c2r(int H, int W, FFTW(complex) *in,
+                                         pixel_t *out, unsigned flags) {
+  return fftw_backend_wrap(FFTW(plan_dft_c2r_2d)(H, W, in, out, flags),
+                           in, out);
+}
+
+static fft_plan_t *fftw_backend_plan_many_r2c(int n, int H, int W,
+                                              pixel_t *in, FFTW(complex) *out,
+                                              unsigned flags) {
+  int dims[2] = { H, W };
+  return fftw_backend_wrap(
+      FFTW(plan_many_dft_r2c)(2, dims, n, in, NULL, 1, W * H,
+                              out, NULL, 1, H * ((W / 2) + 1), flags),
+      in, out);
+}
+
+static fft_plan_t *fftw_backend_plan_many_c2r(int n, int H, int W,
+                                              FFTW(complex) *in, pixel_t *out,
+                                              unsigned flags) {
+  int dims[2] = { H, W };
+  return fftw_backend_wrap(
+      FFTW(plan_many_dft_c2r)(2, dims, n, in, NULL, 1, H * ((W / 2) + 1),
+                              out, NULL, 1, W * H, flags),
+      in, out);
+}
+
+static void fftw_backend_r2c(fft_plan_t *plan, pixel_t *in,
+                             FFTW(complex) *out) {
+  fftw_backend_plan_t *f = (fftw_backend_plan_t*)plan;
+  if ((in == f->in) && ((void*)out == f->out))
+    FFTW(execute)(f->plan);
+  else
+    FFTW(execute_dft_r2c)(f->plan, in, out);
+}
+
+static void fftw_backend_c2r(fft_plan_t *plan, FFTW(complex) *in,
+                             pixel_t *out) {
+  fftw_backend_plan_t *f = (fftw_backend_plan_t*)plan;
+  if (((void*)in == f->in) && (out == f->out))
+    FFTW(execute)(f->plan);
+  else
+    FFTW(execute_dft_c2r)(f->plan, in, out);
+}
+
+static void fftw_backend_destroy(fft_plan_t *plan) {
+  fftw_backend_plan_t *f = (fftw_backend_plan_t*)plan;
+  FFTW(destroy_plan)(f->plan);
+  free(f);
+}
+
+fft_backend_t fftw_backend = {
+  "fftw", fftw_backend_fits, fftw_backend_threads, fftw_backend_cleanup,
+  fftw_backend_malloc, fftw_backend_free,
+  fftw_backend_plan_r2c, fftw_backend_plan_c2r,
+  fftw_backend_plan_many_r2c, fftw_backend_plan_many_c2r,
+  fftw_backend_r2c, fftw_backend_c2r, fftw_backend_destroy
+};
+
+#endif
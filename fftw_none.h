@@ -0,0 +1,42 @@
+/* For a build without FFTW (-DBURNSCOPE_NO_FFTW, see the
+ * burnscope_fft_nofftw make target), in which the builtin backend does all
+ * FFTs (see fft_backend.h): what the rest of the code uses of FFTW besides
+ * its plans. That is its complex type, aligned allocation and the planner
+ * flags, which the builtin backend ignores, and its threads and wisdom
+ * functions, which do nothing. */
+
+typedef pixel_t FFTW(complex)[2];
+
+#define FFTW_MEASURE (0U)
+#define FFTW_EXHAUSTIVE (1U << 3)
+#define FFTW_PATIENT (1U << 5)
+#define FFTW_ESTIMATE (1U << 6)
+
+static inline void *FFTW(malloc)(size_t bytes) {
+  void *p;
+  if (posix_memalign(&p, 64, bytes))
+    return NULL;
+  return p;
+}
+
+static inline void FFTW(free)(void *p) {
+  free(p);
+}
+
+static inline int FFTW(init_threads)(void) {
+  return 1;
+}
+
+static inline void FFTW(plan_with_nthreads)(int n) {
+}
+
+static inline void FFTW(cleanup_threads)(void) {
+}
+
+static inline int FFTW(import_wisdom_from_filename)(const char *path) {
+  return 0;
+}
+
+static inline int FFTW(export_wisdom_to_filename)(const char *path) {
+  return 0;
+}
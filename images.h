@@ -1,6 +1,7 @@
 
 #include "png.h"
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <dirent.h>
 
 typedef struct {
@@ -15,6 +16,82 @@ int cmp_str(const void *a, const void *b) {
   return strcmp(*(const char**)a, *(const char **)b);
 }
 
+/* Besides PNG files, files named *.f32 are read as raw images: a square of
+ * native 32 bit floats, e.g. a kernel computed elsewhere. Returns the side
+ * length of such a file, 0 if fpath is no raw image, -1 if it is not
+ * square. */
+int raw_image_side(const char *fpath) {
+  int l = strlen(fpath);
+  struct stat st;
+
+  if ((l < 4) || strcmp(fpath + l - 4, ".f32"))
+    return 0;
+  if (stat(fpath, &st))
+    return -1;
+
+  int side = (int)sqrt(st.st_size / sizeof(float));
+  while (((off_t)side * side * sizeof(float)) < st.st_size)
+    side ++;
+  if ((! side) || (((off_t)side * side * sizeof(float)) != st.st_size)) {
+    fprintf(stderr, "raw image is not a square of floats: %s\n", fpath);
+    return -1;
+  }
+  return side;
+}
+
+/* Read a raw image of side x side floats, taking every (1 << size_shift)th
+ * pixel, and scale it so that its largest magnitude is 1. Unlike PNG images,
+ * raw images may be negative. */
+bool read_raw_image(const char *fpath, int side, int size_shift,
+                    image_t *img) {
+  FILE *infile = fopen(fpath, "r");
+  if (infile == NULL) {
+    fprintf(stderr, "cannot open file: %s\n", fpath);
+    return false;
+  }
+
+  float *raw = malloc((size_t)side * side * sizeof(float));
+  if ((! raw) || (fread(raw, sizeof(float), side * side, infile) != side * side)) {
+    fprintf(stderr, "cannot read raw image: %s\n", fpath);
+    fclose(infile);
+    free(raw);
+    return false;
+  }
+  fclose(infile);
+
+  img->width = side >> size_shift;
+  img->height = side >> size_shift;
+  img->data = malloc(img->width * img->height * sizeof(*(img->data)));
+  img->path = fpath;
+  if (! img->data) {
+    fprintf(stderr, "no mem for image while loading %s\n", fpath);
+    free(raw);
+    return false;
+  }
+
+  printf(" %4dx%4d", side, side);
+  if (size_shift)
+    printf(" --> %4dx%4d", img->width, img->height);
+  printf(" %s\n", fpath);
+
+  pixel_t pixmax = 0;
+  int x, y;
+  for (y = 0; y < img->height; y++) {
+    for (x = 0; x < img->width; x++) {
+      pixel_t pixel = raw[(y << size_shift) * side + (x << size_shift)];
+      img->data[y * img->width + x] = pixel;
+      pixmax = max(pixmax, fabs(pixel));
+    }
+  }
+  free(raw);
+
+  if (pixmax > 0) {
+    for (x = 0; x < img->width * img->height; x++)
+      img->data[x] /= pixmax;
+  }
+  return true;
+}
+
 
 void read_images(const char *images_dir, image_t **images_p, int *n_images_p, int maxW, int maxH) {
 
@@ -68,6 +145,16 @@ void read_images(const char *images_dir, image_t **images_p, int *n_images_p, in
   for (path_i = 0; path_i < n_files; path_i ++) {
     const char *fpath = files[path_i];
 
+    int raw_side = raw_image_side(fpath);
+    if (raw_side) {
+      if (raw_side > 0) {
+        printf(" %4dx%4d %s\n", raw_side, raw_side, fpath);
+        images_max_w = max(images_max_w, raw_side);
+        images_max_h = max(images_max_h, raw_side);
+      }
+      continue;
+    }
+
     FILE *infile = fopen(fpath, "r");
     if (infile == NULL) {
       fprintf(stderr, "cannot open file: %s\n", fpath);
@@ -143,6 +230,22 @@ void read_images(const char *images_dir, image_t **images_p, int *n_images_p, in
   for (path_i = 0; path_i < n_files; path_i ++) {
     const char *fpath = files[path_i];
 
+    int raw_side = raw_image_side(fpath);
+    if (raw_side) {
+      image_t raw_img;
+      if ((raw_side > 0)
+          && read_raw_image(fpath, raw_side, size_shift, &raw_img)) {
+        n ++;
+        images = realloc(images, sizeof(image_t) * n);
+        if (! images) {
+          fprintf(stderr, "cannot realloc images index to %d\n", (int)(sizeof(image_t) * n));
+          break;
+        }
+        images[n - 1] = raw_img;
+      }
+      continue;
+    }
+
     FILE *infile = fopen(fpath, "r");
     if (infile == NULL) {
       fprintf(stderr, "cannot open file: %s\n", fpath);
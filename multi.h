@@ -0,0 +1,95 @@
+/* Many independent canvases of the same size, stepped together, e.g. for a
+ * thumbnail wall. The canvases lie one after the other in one array, each H
+ * rows of W pixel_t. One batched plan of the FFT backend (plan_many, see
+ * fft_backend.h) transforms all of them in a single call, and the spectral multiply runs over all spectra at
+ * once on the shared worker pool. Canvases too small to split across threads
+ * on their own thus still keep all threads busy, without a process, plans
+ * and threads per canvas. Each canvas has its own kernel spectrum and gain. */
+
+typedef struct {
+  /* FFTW(complex)[H * (W/2+1)], or pixel_t[H * (W/2+1)] if real. */
+  const void *spectrum;
+  bool real;
+  pixel_t gain;
+} multi_kernel_t;
+
+typedef struct {
+  int n;
+  int W;
+  int H;
+  pixel_t *canvas;
+  /* n spectra of H * (W/2+1), one after the other. */
+  FFTW(complex) *spectra;
+  fft_plan_t *forward;
+  fft_plan_t *backward;
+
+  /* the current step */
+  spectral_kernel_t *spectral;
+  const multi_kernel_t *kernels;
+} multi_t;
+
+/* Plan for n canvases of W x H in canvas, which must be allocated by
+ * fft_backend. Planning other than FFTW_ESTIMATE scribbles on the canvas. */
+void multi_init(multi_t *m, int n, int W, int H, pixel_t *canvas,
+                unsigned int planner_flags) {
+  int half_W = (W / 2) + 1;
+
+  bzero(m, sizeof(*m));
+  m->n = n;
+  m->W = W;
+  m->H = H;
+  m->canvas = canvas;
+  m->spectra = fft_backend->malloc(sizeof(FFTW(complex)) * n * H * half_W);
+  if (! m->spectra) {
+    printf("No mem.\n");
+    exit(-1);
+  }
+
+  m->forward = fft_backend->plan_many_r2c(n, H, W, canvas, m->spectra,
+                                          planner_flags);
+  m->backward = fft_backend->plan_many_c2r(n, H, W, m->spectra, canvas,
+                                           planner_flags);
+}
+
+void multi_destroy(multi_t *m) {
+  if (m->forward)
+    fft_backend->destroy(m->forward);
+  if (m->backward)
+    fft_backend->destroy(m->backward);
+  if (m->spectra)
+    fft_backend->free(m->spectra);
+  bzero(m, sizeof(*m));
+}
+
+pixel_t *multi_canvas(multi_t *m, int i) {
+  return m->canvas + (size_t)i * m->W * m->H;
+}
+
+/* Multiply spectrum elements [from, to), counted across all canvases. */
+static void multi_mul(void *arg, int from, int to) {
+  multi_t *m = arg;
+  int per = m->H * ((m->W / 2) + 1);
+  int i;
+
+  for (i = from / per; (i < m->n) && (i * per < to); i++) {
+    const multi_kernel_t *k = &m->kernels[i];
+    pixel_t *pf = (pixel_t*)(m->spectra + (size_t)i * per);
+    int a = max(from, i * per) - i * per;
+    int b = min(to, (i + 1) * per) - i * per;
+    if (k->real)
+      m->spectral->mul_real(pf, k->spectrum, k->gain, a, b);
+    else
+      m->spectral->mul(pf, k->spectrum, k->gain, a, b);
+  }
+}
+
+/* Convolve each canvas in place with its kernel, kernels[0 .. n-1]. */
+void multi_step(multi_t *m, workers_t *workers, spectral_kernel_t *spectral,
+                const multi_kernel_t *kernels) {
+  m->spectral = spectral;
+  m->kernels = kernels;
+
+  fft_backend->r2c(m->forward, m->canvas, m->spectra);
+  workers_run(workers, multi_mul, m, m->n * m->H * ((m->W / 2) + 1), 16);
+  fft_backend->c2r(m->backward, m->spectra, m->canvas);
+}
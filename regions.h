@@ -0,0 +1,119 @@
+/* Spatially varying kernels (-V): K kernels, each weighted per pixel by a
+ * mask, e.g. a large radius in the middle and a small one towards the edges.
+ * The canvas is transformed forward once. Then, for each kernel, its spectrum
+ * is multiplied with the kernel's and transformed back into a scratch canvas,
+ * which is added into the canvas with that kernel's weights. That is one
+ * forward and K backward FFTs per step, instead of K simulations.
+ *
+ * The weights of all kernels add up to 1 at each pixel, so that the blend
+ * burns like a single kernel where the masks leave it to one of them. */
+
+typedef struct {
+  int K;
+  int W;
+  int H;
+  int pitch;
+  /* K * H rows of pitch weights, one canvas of them per kernel. */
+  pixel_t *weights;
+  /* whether kernel k has any weight at all, else its FFT is skipped. */
+  bool *used;
+  /* the forward transform of the canvas, H * (W/2+1). */
+  FFTW(complex) *spectrum;
+  /* a backward transform, H rows of pitch. */
+  pixel_t *scratch;
+
+  /* the current step */
+  pixel_t *canvas;
+  int k;
+  bool first;
+} regions_t;
+
+static void *regions_alloc(size_t bytes) {
+  void *p = FFTW(malloc)(bytes);
+  if (! p) {
+    printf("No mem.\n");
+    exit(-1);
+  }
+  return p;
+}
+
+/* Weigh K kernels by the K masks, each stretched across the view_W x view_H
+ * part of a W x H canvas at view_x, view_y, with rows of pitch pixel_t.
+ * Pixels outside the view take the weights of the nearest edge, pixels that
+ * all masks leave at 0 weigh all kernels the same. */
+void regions_init(regions_t *r, int K, const image_t *masks, int W, int H,
+                  int pitch, int view_x, int view_y, int view_W, int view_H) {
+  int k, x, y;
+
+  bzero(r, sizeof(*r));
+  r->K = K;
+  r->W = W;
+  r->H = H;
+  r->pitch = pitch;
+  r->weights = regions_alloc((size_t)K * H * pitch * sizeof(pixel_t));
+  r->used = malloc_check(K * sizeof(bool));
+  r->spectrum = regions_alloc(sizeof(FFTW(complex)) * H * ((W / 2) + 1));
+  r->scratch = regions_alloc((size_t)H * pitch * sizeof(pixel_t));
+  bzero(r->used, K * sizeof(bool));
+
+  for (y = 0; y < H; y++) {
+    int vy = max(0, min(view_H - 1, y - view_y));
+    for (x = 0; x < W; x++) {
+      int vx = max(0, min(view_W - 1, x - view_x));
+      pixel_t sum = 0;
+      for (k = 0; k < K; k++) {
+        const image_t *m = &masks[k];
+        pixel_t w = m->data[((size_t)vy * m->height / view_H) * m->width
+                            + (size_t)vx * m->width / view_W];
+        w = max(0, w);
+        r->weights[((size_t)k * H + y) * pitch + x] = w;
+        sum += w;
+      }
+      for (k = 0; k < K; k++) {
+        pixel_t *w = &r->weights[((size_t)k * H + y) * pitch + x];
+        *w = (sum > 0)? *w / sum : (pixel_t)1 / K;
+        if (*w > 0)
+          r->used[k] = true;
+      }
+    }
+  }
+}
+
+void regions_destroy(regions_t *r) {
+  if (! r->weights)
+    return;
+  FFTW(free)(r->weights);
+  FFTW(free)(r->spectrum);
+  FFTW(free)(r->scratch);
+  free(r->used);
+  bzero(r, sizeof(*r));
+}
+
+/* Add rows [from / W, to / W) of the scratch canvas into the canvas with the
+ * weights of kernel r->k; the first kernel replaces the canvas. */
+static void regions_add_rows(void *arg, int from, int to) {
+  regions_t *r = arg;
+  int x, y;
+  for (y = from / r->W; y < to / r->W; y++) {
+    pixel_t *row = r->canvas + (size_t)y * r->pitch;
+    const pixel_t *src = r->scratch + (size_t)y * r->pitch;
+    const pixel_t *w = r->weights + ((size_t)r->k * r->H + y) * r->pitch;
+    if (r->first) {
+      for (x = 0; x < r->W; x++)
+        row[x] = w[x] * src[x];
+    }
+    else {
+      for (x = 0; x < r->W; x++)
+        row[x] += w[x] * src[x];
+    }
+  }
+}
+
+/* Add the scratch canvas, convolved with kernel k, into canvas. */
+void regions_add(regions_t *r, workers_t *workers, pixel_t *canvas, int k,
+                 bool first) {
+  r->canvas = canvas;
+  r->k = k;
+  r->first = first;
+  workers_run(workers, regions_add_rows, r, r->W * r->H, r->W);
+}
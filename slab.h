@@ -0,0 +1,177 @@
+/* Runs one canvas across several processes with MPI (the burnscope_fft_mpi
+ * make target), e.g. one per socket or node:
+ *
+ *   mpirun -n 4 ./burnscope_fft_mpi -H -g 8192x8192 -O video.raw
+ *
+ * The canvas is cut into slabs of whole rows, one per rank, laid out like
+ * FFTW's MPI interface wants them: pixbuf holds rows [slab_y0, slab_y0 +
+ * slab_rows) with padded rows, which the fft engine transforms in place with
+ * FFTW's distributed plans, like in memory-lean mode (-L). Each rank seeds,
+ * wraps and mirrors its own slab.
+ *
+ * Rank 0 is the program as usual: the window or headless output, the
+ * controls, recording and playback of parameters. Each frame it shares its
+ * controls with the other ranks, which follow them like a played back session
+ * (-i); started from the same random seed, they seed the same spots, each in
+ * its own slab. Rank 0 gathers the palette indexes for rendering and saving,
+ * and the state for -S. */
+
+#include <mpi.h>
+#include <fftw3-mpi.h>
+
+#ifdef BURNSCOPE_FLOAT
+#define SLAB_MPI_PIXEL MPI_FLOAT
+#else
+#define SLAB_MPI_PIXEL MPI_DOUBLE
+#endif
+
+typedef struct {
+  int rank;
+  int size;
+  /* first row and number of rows of each rank's slab. */
+  int *y0;
+  int *rows;
+} slab_layout_t;
+
+slab_layout_t slab_layout;
+
+/* Call first thing in main(). Returns the number of ranks. */
+int slab_init(int *argc, char ***argv) {
+  int provided;
+  // only the main thread calls MPI; FFTW's and our worker threads don't.
+  MPI_Init_thread(argc, argv, MPI_THREAD_FUNNELED, &provided);
+  MPI_Comm_rank(MPI_COMM_WORLD, &slab_layout.rank);
+  MPI_Comm_size(MPI_COMM_WORLD, &slab_layout.size);
+  return slab_layout.size;
+}
+
+void slab_finish(void) {
+  free(slab_layout.y0);
+  free(slab_layout.rows);
+  MPI_Finalize();
+}
+
+/* This rank's rows of an H x half_W spectrum, and the number of complex
+ * elements to allocate for it, which may be more than rows * half_W. */
+size_t slab_local_size(int H, int half_W, int *y0, int *rows) {
+  ptrdiff_t local_n0, local_0_start;
+  ptrdiff_t n = FFTW(mpi_local_size_2d)(H, half_W, MPI_COMM_WORLD, &local_n0,
+                                        &local_0_start);
+  *y0 = local_0_start;
+  *rows = local_n0;
+
+  slab_layout.y0 = malloc_check(slab_layout.size * sizeof(int));
+  slab_layout.rows = malloc_check(slab_layout.size * sizeof(int));
+  MPI_Allgather(y0, 1, MPI_INT, slab_layout.y0, 1, MPI_INT, MPI_COMM_WORLD);
+  MPI_Allgather(rows, 1, MPI_INT, slab_layout.rows, 1, MPI_INT,
+                MPI_COMM_WORLD);
+  return n;
+}
+
+/* Copy bytes at data from rank 0 to all other ranks. */
+void slab_share(void *data, int bytes) {
+  MPI_Bcast(data, bytes, MPI_BYTE, 0, MPI_COMM_WORLD);
+}
+
+pixel_t slab_max(pixel_t v) {
+  pixel_t all;
+  MPI_Allreduce(&v, &all, 1, SLAB_MPI_PIXEL, MPI_MAX, MPI_COMM_WORLD);
+  return all;
+}
+
+/* Gather the slab rows of a whole-canvas buffer of row_bytes per row into
+ * rank 0's copy. Each rank has filled in only its own rows. */
+void slab_gather_rows(void *buf, int row_bytes) {
+  int i;
+  int n = slab_layout.size;
+  int counts[n];
+  int displs[n];
+  int me = slab_layout.rank;
+
+  for (i = 0; i < n; i++) {
+    counts[i] = slab_layout.rows[i] * row_bytes;
+    displs[i] = slab_layout.y0[i] * row_bytes;
+  }
+  if (me == 0)
+    MPI_Gatherv(MPI_IN_PLACE, counts[0], MPI_BYTE, buf, counts, displs,
+                MPI_BYTE, 0, MPI_COMM_WORLD);
+  else
+    MPI_Gatherv((char*)buf + displs[me], counts[me], MPI_BYTE, NULL, NULL,
+                NULL, MPI_BYTE, 0, MPI_COMM_WORLD);
+}
+
+/* Write the W pixels of each row of all slabs to f on rank 0, top to bottom.
+ * The slabs have rows of pitch pixels. */
+void slab_write_rows(FILE *f, const pixel_t *slab, int W, int pitch) {
+  int i, y;
+  int me = slab_layout.rank;
+
+  if (me) {
+    MPI_Send(slab, slab_layout.rows[me] * pitch, SLAB_MPI_PIXEL, 0, 0,
+             MPI_COMM_WORLD);
+    return;
+  }
+
+  pixel_t *buf = NULL;
+  for (i = 0; i < slab_layout.size; i++) {
+    const pixel_t *rows = slab;
+    if (i) {
+      buf = realloc(buf, max(1, slab_layout.rows[i]) * pitch * sizeof(pixel_t));
+      MPI_Recv(buf, slab_layout.rows[i] * pitch, SLAB_MPI_PIXEL, i, 0,
+               MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+      rows = buf;
+    }
+    for (y = 0; y < slab_layout.rows[i]; y++)
+      fwrite(rows + y * pitch, sizeof(pixel_t), W, f);
+  }
+  free(buf);
+}
+
+/* The rows [lo, hi) of the first range that also are in [lo2, hi2). */
+static void slab_overlap(int lo, int hi, int lo2, int hi2, int *a, int *b) {
+  *a = max(lo, lo2);
+  *b = max(*a, min(hi, hi2));
+}
+
+/* Mirror the canvas about its horizontal axis like mirror_y(), or about its
+ * center like mirror_p() if flip_x: each pixel becomes the minimum of itself
+ * and its mirror image. The mirror image of row y is row H - 1 - y, which is
+ * usually in another rank's slab. */
+void slab_mirror(pixel_t *slab, int W, int H, int pitch, bool flip_x) {
+  int i, x, y;
+  int n = slab_layout.size;
+  int me = slab_layout.rank;
+  int y0 = slab_layout.y0[me];
+  int rows = slab_layout.rows[me];
+  int send_counts[n], send_displs[n], recv_counts[n], recv_displs[n];
+  // the mirror images of my rows are rows [H - y0 - rows, H - y0).
+  int m0 = H - y0 - rows;
+  int m1 = H - y0;
+
+  for (i = 0; i < n; i++) {
+    int qy0 = slab_layout.y0[i];
+    int qy1 = qy0 + slab_layout.rows[i];
+    int a, b;
+    // my rows that mirror rank i's rows.
+    slab_overlap(y0, y0 + rows, H - qy1, H - qy0, &a, &b);
+    send_counts[i] = (b - a) * pitch;
+    send_displs[i] = (a - y0) * pitch;
+    // rank i's rows that mirror mine.
+    slab_overlap(qy0, qy1, m0, m1, &a, &b);
+    recv_counts[i] = (b - a) * pitch;
+    recv_displs[i] = (a - m0) * pitch;
+  }
+
+  pixel_t *mirror = malloc_check(max(1, rows) * pitch * sizeof(pixel_t));
+  MPI_Alltoallv(slab, send_counts, send_displs, SLAB_MPI_PIXEL,
+                mirror, recv_counts, recv_displs, SLAB_MPI_PIXEL,
+                MPI_COMM_WORLD);
+
+  for (y = 0; y < rows; y++) {
+    pixel_t *row = slab + y * pitch;
+    const pixel_t *mrow = mirror + (rows - 1 - y) * pitch;
+    for (x = 0; x < W; x++)
+      row[x] = min(row[x], mrow[flip_x? W - 1 - x : x]);
+  }
+  free(mirror);
+}
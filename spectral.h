@@ -0,0 +1,250 @@
+/* The complex multiplication in the spectral domain, pf[i] *= af[i] * g, that
+ * turns the FFT round trip into a convolution with the apex kernel. Both
+ * arrays are interleaved complex pixel_t (FFTW's layout), from and to count
+ * complex elements. The _real variants take a real-only kernel spectrum
+ * (af[i] is one pixel_t, see apex_cache_make_real()) and just scale both
+ * parts of pf[i].
+ *
+ * There is a plain C version and, on x86, AVX2 and AVX-512 versions for
+ * double and float, picked at runtime by spectral_select(). All of them do
+ * exactly the same operations in the same order and never fuse a multiply
+ * and an add, so the results are bit identical whichever one runs: recorded
+ * parameter files play back the same on any CPU.
+ *
+ * Pass spectral_mul_job() to workers_run() to split the loop across threads.
+ * spectral_bench.c measures the versions against each other. */
+
+#pragma GCC push_options
+#pragma GCC optimize ("fp-contract=off")
+
+typedef void (*spectral_mul_func_t)(pixel_t *pf, const pixel_t *af,
+                                    pixel_t g, int from, int to);
+
+void spectral_mul_c(pixel_t *pf, const pixel_t *af, pixel_t g,
+                    int from, int to) {
+  int i;
+  for (i = from; i < to; i++) {
+    pixel_t a, b, c, d;
+    a = pf[2*i]; b = pf[2*i + 1];
+    c = af[2*i] * g; d = af[2*i + 1] * g;
+    pf[2*i] = (a*c - b*d);
+    pf[2*i + 1] = (b*c + a*d);
+  }
+}
+
+void spectral_mul_real_c(pixel_t *pf, const pixel_t *af, pixel_t g,
+                         int from, int to) {
+  int i;
+  for (i = from; i < to; i++) {
+    pixel_t c = af[i] * g;
+    pf[2*i] *= c;
+    pf[2*i + 1] *= c;
+  }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SPECTRAL_X86
+#include <immintrin.h>
+
+/* For each complex element p = a+ib, q = (c+id) * g:
+ *   t1 = [a*c, b*c]   (p times the real part of q, duplicated)
+ *   t2 = [b*d, a*d]   (p with swapped halves times the imaginary part of q)
+ *   p' = [t1 - t2, t1 + t2]   (alternating, i.e. addsub) */
+
+#ifdef BURNSCOPE_FLOAT
+
+__attribute__((target("avx2")))
+void spectral_mul_avx2(pixel_t *pf, const pixel_t *af, pixel_t g,
+                       int from, int to) {
+  int i;
+  __m256 gv = _mm256_set1_ps(g);
+  for (i = from; i + 4 <= to; i += 4) {
+    __m256 p = _mm256_loadu_ps(pf + 2*i);
+    __m256 q = _mm256_mul_ps(_mm256_loadu_ps(af + 2*i), gv);
+    __m256 t1 = _mm256_mul_ps(p, _mm256_moveldup_ps(q));
+    __m256 t2 = _mm256_mul_ps(_mm256_permute_ps(p, 0xb1), _mm256_movehdup_ps(q));
+    _mm256_storeu_ps(pf + 2*i, _mm256_addsub_ps(t1, t2));
+  }
+  spectral_mul_c(pf, af, g, i, to);
+}
+
+__attribute__((target("avx512f")))
+void spectral_mul_avx512(pixel_t *pf, const pixel_t *af, pixel_t g,
+                         int from, int to) {
+  int i;
+  __m512 gv = _mm512_set1_ps(g);
+  for (i = from; i + 8 <= to; i += 8) {
+    __m512 p = _mm512_loadu_ps(pf + 2*i);
+    __m512 q = _mm512_mul_ps(_mm512_loadu_ps(af + 2*i), gv);
+    __m512 t1 = _mm512_mul_ps(p, _mm512_moveldup_ps(q));
+    __m512 t2 = _mm512_mul_ps(_mm512_permute_ps(p, 0xb1), _mm512_movehdup_ps(q));
+    __m512 r = _mm512_add_ps(t1, t2);
+    r = _mm512_mask_sub_ps(r, 0x5555, t1, t2);
+    _mm512_storeu_ps(pf + 2*i, r);
+  }
+  spectral_mul_c(pf, af, g, i, to);
+}
+
+__attribute__((target("avx2")))
+void spectral_mul_real_avx2(pixel_t *pf, const pixel_t *af, pixel_t g,
+                            int from, int to) {
+  int i;
+  __m256 gv = _mm256_set1_ps(g);
+  const __m256i lo = _mm256_setr_epi32(0, 0, 1, 1, 2, 2, 3, 3);
+  const __m256i hi = _mm256_setr_epi32(4, 4, 5, 5, 6, 6, 7, 7);
+  for (i = from; i + 8 <= to; i += 8) {
+    __m256 c = _mm256_mul_ps(_mm256_loadu_ps(af + i), gv);
+    _mm256_storeu_ps(pf + 2*i, _mm256_mul_ps(_mm256_loadu_ps(pf + 2*i),
+                                             _mm256_permutevar8x32_ps(c, lo)));
+    _mm256_storeu_ps(pf + 2*i + 8, _mm256_mul_ps(_mm256_loadu_ps(pf + 2*i + 8),
+                                                 _mm256_permutevar8x32_ps(c, hi)));
+  }
+  spectral_mul_real_c(pf, af, g, i, to);
+}
+
+__attribute__((target("avx512f")))
+void spectral_mul_real_avx512(pixel_t *pf, const pixel_t *af, pixel_t g,
+                              int from, int to) {
+  int i;
+  __m512 gv = _mm512_set1_ps(g);
+  const __m512i lo = _mm512_setr_epi32(0, 0, 1, 1, 2, 2, 3, 3,
+                                       4, 4, 5, 5, 6, 6, 7, 7);
+  const __m512i hi = _mm512_setr_epi32(8, 8, 9, 9, 10, 10, 11, 11,
+                                       12, 12, 13, 13, 14, 14, 15, 15);
+  for (i = from; i + 16 <= to; i += 16) {
+    __m512 c = _mm512_mul_ps(_mm512_loadu_ps(af + i), gv);
+    _mm512_storeu_ps(pf + 2*i, _mm512_mul_ps(_mm512_loadu_ps(pf + 2*i),
+                                             _mm512_permutexvar_ps(lo, c)));
+    _mm512_storeu_ps(pf + 2*i + 16, _mm512_mul_ps(_mm512_loadu_ps(pf + 2*i + 16),
+                                                  _mm512_permutexvar_ps(hi, c)));
+  }
+  spectral_mul_real_c(pf, af, g, i, to);
+}
+
+#else
+
+__attribute__((target("avx2")))
+void spectral_mul_avx2(pixel_t *pf, const pixel_t *af, pixel_t g,
+                       int from, int to) {
+  int i;
+  __m256d gv = _mm256_set1_pd(g);
+  for (i = from; i + 2 <= to; i += 2) {
+    __m256d p = _mm256_loadu_pd(pf + 2*i);
+    __m256d q = _mm256_mul_pd(_mm256_loadu_pd(af + 2*i), gv);
+    __m256d t1 = _mm256_mul_pd(p, _mm256_movedup_pd(q));
+    __m256d t2 = _mm256_mul_pd(_mm256_permute_pd(p, 0x5), _mm256_permute_pd(q, 0xf));
+    _mm256_storeu_pd(pf + 2*i, _mm256_addsub_pd(t1, t2));
+  }
+  spectral_mul_c(pf, af, g, i, to);
+}
+
+__attribute__((target("avx512f")))
+void spectral_mul_avx512(pixel_t *pf, const pixel_t *af, pixel_t g,
+                         int from, int to) {
+  int i;
+  __m512d gv = _mm512_set1_pd(g);
+  for (i = from; i + 4 <= to; i += 4) {
+    __m512d p = _mm512_loadu_pd(pf + 2*i);
+    __m512d q = _mm512_mul_pd(_mm512_loadu_pd(af + 2*i), gv);
+    __m512d t1 = _mm512_mul_pd(p, _mm512_movedup_pd(q));
+    __m512d t2 = _mm512_mul_pd(_mm512_permute_pd(p, 0x55), _mm512_permute_pd(q, 0xff));
+    __m512d r = _mm512_add_pd(t1, t2);
+    r = _mm512_mask_sub_pd(r, 0x55, t1, t2);
+    _mm512_storeu_pd(pf + 2*i, r);
+  }
+  spectral_mul_c(pf, af, g, i, to);
+}
+
+__attribute__((target("avx2")))
+void spectral_mul_real_avx2(pixel_t *pf, const pixel_t *af, pixel_t g,
+                            int from, int to) {
+  int i;
+  __m256d gv = _mm256_set1_pd(g);
+  for (i = from; i + 4 <= to; i += 4) {
+    __m256d c = _mm256_mul_pd(_mm256_loadu_pd(af + i), gv);
+    _mm256_storeu_pd(pf + 2*i, _mm256_mul_pd(_mm256_loadu_pd(pf + 2*i),
+                                             _mm256_permute4x64_pd(c, 0x50)));
+    _mm256_storeu_pd(pf + 2*i + 4, _mm256_mul_pd(_mm256_loadu_pd(pf + 2*i + 4),
+                                                 _mm256_permute4x64_pd(c, 0xfa)));
+  }
+  spectral_mul_real_c(pf, af, g, i, to);
+}
+
+__attribute__((target("avx512f")))
+void spectral_mul_real_avx512(pixel_t *pf, const pixel_t *af, pixel_t g,
+                              int from, int to) {
+  int i;
+  __m512d gv = _mm512_set1_pd(g);
+  const __m512i lo = _mm512_setr_epi64(0, 0, 1, 1, 2, 2, 3, 3);
+  const __m512i hi = _mm512_setr_epi64(4, 4, 5, 5, 6, 6, 7, 7);
+  for (i = from; i + 8 <= to; i += 8) {
+    __m512d c = _mm512_mul_pd(_mm512_loadu_pd(af + i), gv);
+    _mm512_storeu_pd(pf + 2*i, _mm512_mul_pd(_mm512_loadu_pd(pf + 2*i),
+                                             _mm512_permutexvar_pd(lo, c)));
+    _mm512_storeu_pd(pf + 2*i + 8, _mm512_mul_pd(_mm512_loadu_pd(pf + 2*i + 8),
+                                                 _mm512_permutexvar_pd(hi, c)));
+  }
+  spectral_mul_real_c(pf, af, g, i, to);
+}
+
+#endif
+
+static bool spectral_has_avx2(void) {
+  return __builtin_cpu_supports("avx2");
+}
+
+static bool spectral_has_avx512(void) {
+  return __builtin_cpu_supports("avx512f");
+}
+
+#endif // x86
+
+static bool spectral_always(void) {
+  return true;
+}
+
+#pragma GCC pop_options
+
+typedef struct {
+  const char *name;
+  spectral_mul_func_t mul;
+  spectral_mul_func_t mul_real;
+  bool (*supported)(void);
+} spectral_kernel_t;
+
+/* Fastest first. */
+spectral_kernel_t spectral_kernels[] = {
+#ifdef SPECTRAL_X86
+  { "avx512", spectral_mul_avx512, spectral_mul_real_avx512, spectral_has_avx512 },
+  { "avx2", spectral_mul_avx2, spectral_mul_real_avx2, spectral_has_avx2 },
+#endif
+  { "c", spectral_mul_c, spectral_mul_real_c, spectral_always },
+};
+
+#define N_SPECTRAL_KERNELS (sizeof(spectral_kernels) / sizeof(spectral_kernels[0]))
+
+/* Return the fastest kernel this CPU can run, or the one called name, if
+ * name is not NULL and this CPU can run it. */
+spectral_kernel_t *spectral_select(const char *name) {
+  int i;
+  for (i = 0; i < N_SPECTRAL_KERNELS; i++) {
+    spectral_kernel_t *k = &spectral_kernels[i];
+    if (! k->supported())
+      continue;
+    if ((! name) || (strcmp(name, k->name) == 0))
+      return k;
+  }
+  return NULL;
+}
+
+typedef struct {
+  spectral_mul_func_t func;
+  pixel_t *pf;
+  const pixel_t *af;
+  pixel_t g;
+} spectral_job_t;
+
+void spectral_mul_job(void *arg, int from, int to) {
+  spectral_job_t *job = arg;
+  job->func(job->pf, job->af, job->g, from, to);
+}
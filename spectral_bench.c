@@ -0,0 +1,199 @@
+/* spectral_bench.c
+ * (c) 2014 Neels Hofmeyr <neels@hofmeyr.de>
+ *
+ * This file is part of burnscope, published under the GNU General Public
+ * License v3.
+ */
+
+/* Microbenchmark for the spectral multiply of burnscope_fft (spectral.h).
+ * Runs every kernel this CPU supports on a spectrum of the given canvas size,
+ * on one thread and on the worker pool, and reports the time per frame and
+ * GFLOP/s next to the plain C loop, for a complex and for a real-only kernel
+ * spectrum (speedups are relative to the complex C loop). Also checks that
+ * every kernel gives bit identical results. Build with -DBURNSCOPE_FLOAT
+ * (spectral_benchf) to measure the single precision kernels. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <limits.h>
+#include <SDL2/SDL.h>
+#include <SDL2/SDL_thread.h>
+
+#define min(A,B) ((A) > (B)? (B) : (A))
+#define max(A,B) ((A) > (B)? (A) : (B))
+
+#ifdef BURNSCOPE_FLOAT
+typedef float pixel_t;
+#define PRECISION_NAME "float"
+#else
+typedef double pixel_t;
+#define PRECISION_NAME "double"
+#endif
+
+static void *malloc_check(size_t len) {
+  void *p;
+  p = malloc(len);
+  if (! p) {
+    printf("No mem.\n");
+    exit(-1);
+  }
+  return p;
+}
+
+#include "workers.h"
+#include "spectral.h"
+
+/* Per complex element: two multiplications for the gain, four
+ * multiplications and two additions for the complex product. With a real
+ * kernel spectrum: one multiplication for the gain and two for the product. */
+#define FLOPS_PER_ELEMENT 8
+#define FLOPS_PER_ELEMENT_REAL 3
+
+int n_elements;
+int reps;
+pixel_t *pf;
+pixel_t *af;
+pixel_t *af_real;
+pixel_t *pf_start;
+pixel_t *reference;
+pixel_t *reference_real;
+
+double bench(const char *name, workers_t *pool, spectral_mul_func_t func,
+             bool real, double ref_ms) {
+  spectral_job_t job = { func, pf, real? af_real : af, 1.0005 };
+  int i;
+
+  memcpy(pf, pf_start, n_elements * 2 * sizeof(pixel_t));
+  // warm up and check the result against the C loop.
+  workers_run(pool, spectral_mul_job, &job, n_elements, 16);
+  bool exact = (memcmp(pf, real? reference_real : reference,
+                       n_elements * 2 * sizeof(pixel_t)) == 0);
+
+  Uint64 freq = SDL_GetPerformanceFrequency();
+  Uint64 start = SDL_GetPerformanceCounter();
+  for (i = 0; i < reps; i++) {
+    // keep the values from growing out of range over the repetitions.
+    job.g = (i & 1)? 1.0005 : (1. / 1.0005);
+    workers_run(pool, spectral_mul_job, &job, n_elements, 16);
+  }
+  Uint64 elapsed = SDL_GetPerformanceCounter() - start;
+
+  double ms = 1000. * elapsed / freq / reps;
+  double gflops = (double)(real? FLOPS_PER_ELEMENT_REAL : FLOPS_PER_ELEMENT)
+                  * n_elements / (ms * 1e6);
+  printf("%-13s %3d threads %10.3f ms %8.2f GFLOP/s %6.2fx  %s\n",
+         name, pool->n, ms, gflops, ref_ms > 0? ref_ms / ms : 1.,
+         exact? "exact" : "RESULTS DIFFER");
+  return ms;
+}
+
+int main(int argc, char *argv[])
+{
+  int W = 3840;
+  int H = 2160;
+  int threads = SDL_GetCPUCount();
+  int c;
+
+  reps = 50;
+
+  while ((c = getopt(argc, argv, "hg:n:t:")) != -1) {
+    switch (c) {
+      case 'g':
+        {
+          char arg[strlen(optarg) + 1];
+          strcpy(arg, optarg);
+          char *ch = arg;
+          while ((*ch) && ((*ch) != 'x')) ch ++;
+          if ((*ch) == 'x') {
+            *ch = 0;
+            ch ++;
+            W = atoi(arg);
+            H = atoi(ch);
+          }
+          else {
+            W = H = atoi(arg);
+          }
+        }
+        break;
+
+      case 'n':
+        reps = max(1, atoi(optarg));
+        break;
+
+      case 't':
+        threads = max(1, atoi(optarg));
+        break;
+
+      default:
+        printf(
+"Usage: spectral_bench [-g WxH] [-n reps] [-t threads]\n"
+"Time the spectral multiply of burnscope_fft for a WxH canvas, i.e. on\n"
+"H * (W/2 + 1) complex " PRECISION_NAME " elements.\n"
+"  -g WxH   Canvas size (default: %dx%d).\n"
+"  -n reps  Repetitions per measurement (default: %d).\n"
+"  -t N     Threads for the multi-threaded runs (default: %d).\n",
+          W, H, reps, threads);
+        return c == 'h'? 0 : 1;
+    }
+  }
+
+  n_elements = H * ((W / 2) + 1);
+  size_t bytes = (size_t)n_elements * 2 * sizeof(pixel_t);
+  pf = malloc_check(bytes);
+  af = malloc_check(bytes);
+  af_real = malloc_check(bytes / 2);
+  pf_start = malloc_check(bytes);
+  reference = malloc_check(bytes);
+  reference_real = malloc_check(bytes);
+
+  int i;
+  srandom(1);
+  for (i = 0; i < n_elements * 2; i++) {
+    pf_start[i] = (pixel_t)random() / INT_MAX - .5;
+    af[i] = (pixel_t)random() / INT_MAX - .5;
+  }
+  for (i = 0; i < n_elements; i++)
+    af_real[i] = af[2*i];
+  memcpy(reference, pf_start, bytes);
+  spectral_mul_c(reference, af, 1.0005, 0, n_elements);
+  memcpy(reference_real, pf_start, bytes);
+  spectral_mul_real_c(reference_real, af_real, 1.0005, 0, n_elements);
+
+  printf("%dx%d: %d complex %s elements, %d MiB per array\n",
+         W, H, n_elements, PRECISION_NAME, (int)(bytes >> 20));
+
+  workers_t one;
+  workers_t pool;
+  workers_init(&one, 1);
+  workers_init(&pool, threads);
+
+  double ref_ms = bench("c", &one, spectral_mul_c, false, 0);
+
+  for (i = 0; i < N_SPECTRAL_KERNELS; i++) {
+    spectral_kernel_t *k = &spectral_kernels[i];
+    char real_name[64];
+    snprintf(real_name, sizeof(real_name), "%s real", k->name);
+
+    if (! k->supported()) {
+      printf("%-13s not supported by this CPU\n", k->name);
+      continue;
+    }
+    if (k->mul != spectral_mul_c)
+      bench(k->name, &one, k->mul, false, ref_ms);
+    if (threads > 1)
+      bench(k->name, &pool, k->mul, false, ref_ms);
+    bench(real_name, &one, k->mul_real, true, ref_ms);
+    if (threads > 1)
+      bench(real_name, &pool, k->mul_real, true, ref_ms);
+  }
+
+  workers_destroy(&one);
+  workers_destroy(&pool);
+  return 0;
+}
+
+// vim: ts=2 sw=2 et
@@ -0,0 +1,184 @@
+/* Direct convolution with a small kernel, as an alternative to the FFT round
+ * trip. The kernel is a list of nonzero taps at offsets of at most
+ * STENCIL_MAX_R pixels. The canvas wraps around like it does for the FFT:
+ * each step first copies it to a source buffer with a periodic border, then
+ * sums up the taps into the canvas, in bands of rows across the worker
+ * threads and in tiles of STENCIL_TILE_W columns, so that the rows a tile
+ * needs stay in cache. The inner loop is a plain axpy that the compiler
+ * vectorizes, built for AVX-512, AVX2 and baseline x86 and picked at
+ * runtime.
+ *
+ * For a kernel with n taps this costs 2n flops per pixel, whereas the two
+ * FFTs cost in the order of log2(W*H) flops per pixel each. See
+ * stencil_worth_it(). */
+
+#define STENCIL_MAX_R 16
+#define STENCIL_TILE_W 1024
+
+/* Use the stencil when a kernel has fewer taps than this times log2(W*H). */
+#define STENCIL_TAPS_PER_LOG2 4
+
+typedef struct {
+  int dx;
+  int dy;
+  pixel_t v;
+} stencil_tap_t;
+
+typedef struct {
+  int W;
+  int H;
+  int pitch;
+  /* source buffer: the canvas with a periodic border of STENCIL_MAX_R. */
+  pixel_t *src;
+  int src_pitch;
+
+  /* the current step */
+  pixel_t *buf;
+  int r;
+  const stencil_tap_t *taps;
+  /* the taps' values scaled by the gain; room for tap_v_len of them, grown
+   * as kernels with more taps come along. */
+  pixel_t *tap_v;
+  int tap_v_len;
+  int n_taps;
+} stencil_t;
+
+/* Collect the nonzero taps of a kernel laid out like for the FFT: H rows of
+ * pitch pixel_t, with the origin at 0,0 and negative offsets wrapping around
+ * to the far edges. Each tap is scaled by scale. Return a malloced list of
+ * the taps and their number and maximum offset in *n_taps and *r, or NULL if
+ * the kernel reaches further than STENCIL_MAX_R. */
+stencil_tap_t *stencil_taps(const pixel_t *k, int W, int H, int pitch,
+                            pixel_t scale, int *n_taps, int *r) {
+  int x, y, dx, dy;
+  int n_all = 0;
+  int n = 0;
+  int max_r = min(STENCIL_MAX_R, (min(W, H) - 1) / 2);
+
+  for (y = 0; y < H; y++) {
+    for (x = 0; x < W; x++) {
+      if (k[y * pitch + x] != 0)
+        n_all ++;
+    }
+  }
+
+  stencil_tap_t *taps = malloc_check(max(1, n_all) * sizeof(stencil_tap_t));
+  *r = 0;
+
+  for (dy = -max_r; dy <= max_r; dy++) {
+    for (dx = -max_r; dx <= max_r; dx++) {
+      pixel_t v = k[((dy + H) % H) * pitch + ((dx + W) % W)];
+      if (v == 0)
+        continue;
+      taps[n].dx = dx;
+      taps[n].dy = dy;
+      taps[n].v = v * scale;
+      n ++;
+      *r = max(*r, max(abs(dx), abs(dy)));
+    }
+  }
+
+  if (n != n_all) {
+    free(taps);
+    return NULL;
+  }
+  *n_taps = n;
+  return taps;
+}
+
+bool stencil_worth_it(int n_taps, int W, int H) {
+  return n_taps < (STENCIL_TAPS_PER_LOG2 * log2((double)W * H));
+}
+
+void stencil_init(stencil_t *st, int W, int H, int pitch) {
+  bzero(st, sizeof(*st));
+  st->W = W;
+  st->H = H;
+  st->pitch = pitch;
+  st->src_pitch = W + 2 * STENCIL_MAX_R;
+  st->src = malloc_check((size_t)st->src_pitch * (H + 2 * STENCIL_MAX_R)
+                        * sizeof(pixel_t));
+}
+
+void stencil_destroy(stencil_t *st) {
+  free(st->src);
+  free(st->tap_v);
+  bzero(st, sizeof(*st));
+}
+
+/* Source pixel at canvas position x, y, for -STENCIL_MAX_R <= x, y. */
+static pixel_t *stencil_src(stencil_t *st, int x, int y) {
+  return st->src + (y + STENCIL_MAX_R) * st->src_pitch + x + STENCIL_MAX_R;
+}
+
+/* Copy canvas rows [from, to) (counted from -r) with their wrapped border. */
+static void stencil_pad_rows(void *arg, int from, int to) {
+  stencil_t *st = arg;
+  int r = st->r;
+  int row;
+  for (row = from / st->src_pitch; row < to / st->src_pitch; row++) {
+    int y = row - r;
+    pixel_t *in = st->buf + ((y + st->H) % st->H) * st->pitch;
+    pixel_t *out = stencil_src(st, 0, y);
+    memcpy(out - r, in + st->W - r, r * sizeof(pixel_t));
+    memcpy(out, in, st->W * sizeof(pixel_t));
+    memcpy(out + st->W, in, r * sizeof(pixel_t));
+  }
+}
+
+#pragma GCC push_options
+#pragma GCC optimize ("fp-contract=off")
+
+#if defined(__x86_64__) && defined(__GNUC__) && ! defined(__clang__)
+__attribute__((target_clones("avx512f", "avx2", "default")))
+#endif
+static void stencil_axpy(pixel_t *acc, const pixel_t *src, pixel_t v, int n) {
+  int i;
+  for (i = 0; i < n; i++)
+    acc[i] += v * src[i];
+}
+
+#pragma GCC pop_options
+
+/* Convolve canvas rows [from / W, to / W). */
+static void stencil_rows(void *arg, int from, int to) {
+  stencil_t *st = arg;
+  pixel_t acc[STENCIL_TILE_W];
+  int y, x0, t;
+
+  for (y = from / st->W; y < to / st->W; y++) {
+    pixel_t *out = st->buf + y * st->pitch;
+    for (x0 = 0; x0 < st->W; x0 += STENCIL_TILE_W) {
+      int n = min(STENCIL_TILE_W, st->W - x0);
+      bzero(acc, n * sizeof(pixel_t));
+      for (t = 0; t < st->n_taps; t++) {
+        const stencil_tap_t *tap = &st->taps[t];
+        stencil_axpy(acc, stencil_src(st, x0 - tap->dx, y - tap->dy),
+                     st->tap_v[t], n);
+      }
+      memcpy(out + x0, acc, n * sizeof(pixel_t));
+    }
+  }
+}
+
+/* Convolve the canvas buf in place with the taps, scaled by g. */
+void stencil_convolve(stencil_t *st, workers_t *workers, pixel_t *buf,
+                      const stencil_tap_t *taps, int n_taps, int r, pixel_t g) {
+  int t;
+
+  st->buf = buf;
+  st->r = r;
+  st->taps = taps;
+  st->n_taps = n_taps;
+  if (n_taps > st->tap_v_len) {
+    free(st->tap_v);
+    st->tap_v = malloc_check(n_taps * sizeof(pixel_t));
+    st->tap_v_len = n_taps;
+  }
+  for (t = 0; t < n_taps; t++)
+    st->tap_v[t] = taps[t].v * g;
+
+  workers_run(workers, stencil_pad_rows, st, (st->H + 2 * r) * st->src_pitch,
+              st->src_pitch);
+  workers_run(workers, stencil_rows, st, st->H * st->W, st->W);
+}
@@ -0,0 +1,245 @@
+/* Overlap-save convolution for canvases too large for one FFT of the whole
+ * canvas, or whose spectra don't fit into the memory budget (-B). The kernel
+ * has compact support (see build_apex()), so each output pixel only depends
+ * on the canvas within the kernel radius around it. The canvas is cut into
+ * blocks of B x B pixels; each block is convolved as a T x T tile, the block
+ * plus a halo of halo pixels on all sides, with T = B + 2 * halo. The
+ * circular convolution of the tile wraps around only within the halo, which
+ * is then thrown away. The canvas itself wraps around like it does for the
+ * FFT.
+ *
+ * The blocks are done in strips of B rows, top to bottom, the tiles of a
+ * strip in parallel, one tile buffer per worker thread, each with its own
+ * single threaded plans of the FFT backend. The result of a strip is
+ * collected in a strip buffer and copied into the canvas when the strip is
+ * done. The halo rows that the next strip needs from the overwritten strip
+ * above it are kept in a copy, and so are the first rows of the canvas for
+ * the last strip. Apart from the canvas, this needs the tile buffers, the
+ * tile sized kernel spectrum and T rows of the canvas width, see
+ * tiled_bytes(). */
+
+/* The halo is this fraction of the tile size, so the kernel radius is
+ * limited to T / TILED_HALO_DIV. */
+#define TILED_HALO_DIV 8
+#define TILED_MIN_T 64
+#define TILED_MAX_T 4096
+
+/* The largest canvas width and height, so that W * H fits into an int. */
+#define TILED_MAX_PIXELS 32768
+/* The memory budget when the canvas is too large for one FFT and none was
+ * given (-B). */
+#define TILED_DEFAULT_BUDGET_MB 1024
+
+typedef struct {
+  int W;
+  int H;
+  int pitch;
+  int T;
+  int halo;
+  int B;
+  /* row stride of a tile, padded to hold its spectrum in place. */
+  int tile_pitch;
+  int n_tiles;
+  /* one tile buffer and pair of plans per worker thread. */
+  int n_bufs;
+  pixel_t **bufs;
+  fft_plan_t **forward;
+  fft_plan_t **backward;
+  /* the first halo rows of the canvas, as they were before this step. */
+  pixel_t *top;
+  /* the halo rows above the current strip, as they were before this step. */
+  pixel_t *above;
+  /* the result of the current strip. */
+  pixel_t *out;
+
+  /* the current step */
+  pixel_t *buf;
+  spectral_kernel_t *spectral;
+  const void *spectrum;
+  bool real;
+  pixel_t g;
+  int y0;
+  int rows;
+} tiled_t;
+
+/* Memory needed besides the canvas, for tiles of T x T on a canvas of width
+ * W with n_bufs worker threads. */
+size_t tiled_bytes(int T, int W, int n_bufs) {
+  size_t tile = (size_t)T * 2 * ((T / 2) + 1) * sizeof(pixel_t);
+  return n_bufs * tile
+         + (size_t)T * ((T / 2) + 1) * sizeof(FFTW(complex))
+         + (size_t)T * W * sizeof(pixel_t);
+}
+
+/* The largest tile size that fits into budget bytes, or 0 if none does. */
+int tiled_pick_size(int W, int H, int n_bufs, size_t budget) {
+  int T;
+  for (T = TILED_MAX_T; T >= TILED_MIN_T; T /= 2) {
+    if ((T <= min(W, H)) && (tiled_bytes(T, W, n_bufs) <= budget))
+      return T;
+  }
+  return 0;
+}
+
+static pixel_t *tiled_alloc(size_t bytes) {
+  pixel_t *p = fft_backend->malloc(bytes);
+  if (! p) {
+    printf("No mem.\n");
+    exit(-1);
+  }
+  return p;
+}
+
+/* Plan for tiles of T x T on a W x H canvas with rows of pitch pixel_t, with
+ * n_bufs tile buffers. T must not exceed W or H. The plans are executed from
+ * the worker threads at the same time, so make them with the backend set to
+ * one thread. */
+void tiled_init(tiled_t *t, int W, int H, int pitch, int T, int n_bufs,
+                unsigned int planner_flags) {
+  int i;
+
+  bzero(t, sizeof(*t));
+  t->W = W;
+  t->H = H;
+  t->pitch = pitch;
+  t->T = T;
+  t->halo = T / TILED_HALO_DIV;
+  t->B = T - 2 * t->halo;
+  t->tile_pitch = 2 * ((T / 2) + 1);
+  t->n_tiles = (W + t->B - 1) / t->B;
+  t->n_bufs = n_bufs;
+  t->bufs = malloc_check(n_bufs * sizeof(pixel_t*));
+  t->forward = malloc_check(n_bufs * sizeof(fft_plan_t*));
+  t->backward = malloc_check(n_bufs * sizeof(fft_plan_t*));
+  for (i = 0; i < n_bufs; i++) {
+    t->bufs[i] = tiled_alloc((size_t)T * t->tile_pitch * sizeof(pixel_t));
+    t->forward[i] = fft_backend->plan_r2c(T, T, t->bufs[i],
+                                          (FFTW(complex)*)t->bufs[i],
+                                          planner_flags);
+    t->backward[i] = fft_backend->plan_c2r(T, T, (FFTW(complex)*)t->bufs[i],
+                                           t->bufs[i], planner_flags);
+  }
+  t->top = tiled_alloc((size_t)t->halo * W * sizeof(pixel_t));
+  t->above = tiled_alloc((size_t)t->halo * W * sizeof(pixel_t));
+  t->out = tiled_alloc((size_t)t->B * W * sizeof(pixel_t));
+}
+
+void tiled_destroy(tiled_t *t) {
+  int i;
+  for (i = 0; i < t->n_bufs; i++) {
+    fft_backend->destroy(t->forward[i]);
+    fft_backend->destroy(t->backward[i]);
+    fft_backend->free(t->bufs[i]);
+  }
+  free(t->forward);
+  free(t->backward);
+  free(t->bufs);
+  if (t->top) {
+    fft_backend->free(t->top);
+    fft_backend->free(t->above);
+    fft_backend->free(t->out);
+  }
+  bzero(t, sizeof(*t));
+}
+
+/* Canvas row y as it was before this step, for -halo <= y < H + halo. */
+static const pixel_t *tiled_src_row(tiled_t *t, int y) {
+  y = (y + t->H) % t->H;
+  if (y >= t->y0)
+    return t->buf + (size_t)y * t->pitch;
+  if (y >= (t->y0 - t->halo))
+    return t->above + (size_t)(y - (t->y0 - t->halo)) * t->W;
+  // below the last strip, wrapped around to the top.
+  return t->top + (size_t)y * t->W;
+}
+
+/* Copy n pixels of row from x on, wrapping around at W. n <= W. */
+static void tiled_copy_wrapped(pixel_t *dst, const pixel_t *row, int W,
+                               int x, int n) {
+  x = (x + W) % W;
+  int n1 = min(n, W - x);
+  memcpy(dst, row + x, n1 * sizeof(pixel_t));
+  memcpy(dst + n1, row, (n - n1) * sizeof(pixel_t));
+}
+
+/* Convolve the block at x0 of the current strip into the strip buffer, in
+ * tile buffer n. */
+static void tiled_tile(tiled_t *t, int n, int x0) {
+  pixel_t *tile = t->bufs[n];
+  int cols = min(t->B, t->W - x0);
+  int n_rows = t->rows + 2 * t->halo;
+  int n_cols = cols + 2 * t->halo;
+  int r;
+
+  // A partial block leaves part of the tile unused; zeros there only ever
+  // reach the halo of the result.
+  for (r = 0; r < t->T; r++) {
+    pixel_t *dst = tile + (size_t)r * t->tile_pitch;
+    if (r < n_rows) {
+      tiled_copy_wrapped(dst, tiled_src_row(t, t->y0 - t->halo + r), t->W,
+                         x0 - t->halo, n_cols);
+      bzero(dst + n_cols, (t->T - n_cols) * sizeof(pixel_t));
+    }
+    else
+      bzero(dst, t->T * sizeof(pixel_t));
+  }
+
+  fft_backend->r2c(t->forward[n], tile, (FFTW(complex)*)tile);
+  if (t->real)
+    t->spectral->mul_real(tile, t->spectrum, t->g, 0, t->T * ((t->T / 2) + 1));
+  else
+    t->spectral->mul(tile, t->spectrum, t->g, 0, t->T * ((t->T / 2) + 1));
+  fft_backend->c2r(t->backward[n], (FFTW(complex)*)tile, tile);
+
+  for (r = 0; r < t->rows; r++) {
+    memcpy(t->out + (size_t)r * t->W + x0,
+           tile + (size_t)(r + t->halo) * t->tile_pitch + t->halo,
+           cols * sizeof(pixel_t));
+  }
+}
+
+/* Worker slice n uses tile buffer n for tiles n, n + n_bufs, ... */
+static void tiled_tiles(void *arg, int from, int to) {
+  tiled_t *t = arg;
+  int per = t->T * t->T;
+  int n, i;
+  for (n = from / per; n < to / per; n++) {
+    for (i = n; i < t->n_tiles; i += t->n_bufs)
+      tiled_tile(t, n, i * t->B);
+  }
+}
+
+/* Convolve the canvas buf in place with a T x T kernel spectrum (FFTW(complex)
+ * or, if real, pixel_t [T * (T/2+1)]), scaled by g. The kernel must not reach
+ * further than halo pixels. */
+void tiled_convolve(tiled_t *t, workers_t *workers, spectral_kernel_t *spectral,
+                    pixel_t *buf, const void *spectrum, bool real, pixel_t g) {
+  int r;
+
+  t->buf = buf;
+  t->spectral = spectral;
+  t->spectrum = spectrum;
+  t->real = real;
+  t->g = g;
+
+  for (r = 0; r < t->halo; r++)
+    memcpy(t->top + (size_t)r * t->W, buf + (size_t)r * t->pitch,
+           t->W * sizeof(pixel_t));
+
+  for (t->y0 = 0; t->y0 < t->H; t->y0 += t->rows) {
+    t->rows = min(t->B, t->H - t->y0);
+    workers_run(workers, tiled_tiles, t, t->n_bufs * t->T * t->T,
+                t->T * t->T);
+
+    // keep what the next strip needs of this one before overwriting it.
+    for (r = 0; r < t->halo; r++) {
+      memcpy(t->above + (size_t)r * t->W,
+             buf + (size_t)(t->y0 + t->rows - t->halo + r) * t->pitch,
+             t->W * sizeof(pixel_t));
+    }
+    for (r = 0; r < t->rows; r++) {
+      memcpy(buf + (size_t)(t->y0 + r) * t->pitch, t->out + (size_t)r * t->W,
+             t->W * sizeof(pixel_t));
+    }
+  }
+}
@@ -0,0 +1,132 @@
+/* A small pool of SDL threads to split loops over an index range. The pool
+ * has n threads in total: workers_run() hands one slice of the range to each
+ * of the n - 1 worker threads, runs the first slice on the calling thread and
+ * returns when all slices are done. burnscope_fft sizes it like FFTW's thread
+ * pool (-t), so the loops between the FFTs use the same number of cores. */
+
+typedef void (*workers_func_t)(void *arg, int from, int to);
+
+/* Ranges shorter than this per thread run on the calling thread alone; waking
+ * up the workers would cost more than it saves. */
+#define WORKERS_MIN_SLICE 4096
+
+struct workers;
+
+typedef struct {
+  struct workers *pool;
+  int idx;
+  SDL_Thread *thread;
+  SDL_sem *go;
+} worker_t;
+
+typedef struct workers {
+  int n;
+  worker_t *w;
+  SDL_sem *done;
+
+  workers_func_t func;
+  void *arg;
+  int len;
+  int align;
+  volatile bool quit;
+} workers_t;
+
+/* Slice boundaries are multiples of pool->align, except for the end of the
+ * last slice. */
+static void workers_slice(workers_t *pool, int idx, int *from, int *to) {
+  int a = pool->align;
+  *from = (int)(((long long)pool->len * idx) / pool->n) / a * a;
+  if (idx == (pool->n - 1))
+    *to = pool->len;
+  else
+    *to = (int)(((long long)pool->len * (idx + 1)) / pool->n) / a * a;
+}
+
+/* The index of the slice of the current workers_run() that starts at from,
+ * e.g. to pick per thread scratch space. */
+int workers_slot(workers_t *pool, int from) {
+  int idx, f, t;
+  // a run on the calling thread alone has just the one slice.
+  if (from == 0)
+    return 0;
+  for (idx = 1; idx < pool->n; idx++) {
+    workers_slice(pool, idx, &f, &t);
+    if ((f == from) && (t > f))
+      return idx;
+  }
+  return 0;
+}
+
+static int worker_thread(void *arg) {
+  worker_t *w = arg;
+  workers_t *pool = w->pool;
+  int from, to;
+
+  while (1) {
+    SDL_SemWait(w->go);
+    if (pool->quit)
+      break;
+    workers_slice(pool, w->idx, &from, &to);
+    if (to > from)
+      pool->func(pool->arg, from, to);
+    SDL_SemPost(pool->done);
+  }
+  return 0;
+}
+
+void workers_init(workers_t *pool, int n) {
+  int i;
+  bzero(pool, sizeof(*pool));
+  pool->n = max(1, n);
+  pool->w = malloc_check(pool->n * sizeof(worker_t));
+  pool->done = SDL_CreateSemaphore(0);
+
+  for (i = 1; i < pool->n; i++) {
+    worker_t *w = &pool->w[i];
+    w->pool = pool;
+    w->idx = i;
+    w->go = SDL_CreateSemaphore(0);
+    w->thread = SDL_CreateThread(worker_thread, "worker", w);
+  }
+}
+
+void workers_destroy(workers_t *pool) {
+  int i;
+  pool->quit = true;
+  for (i = 1; i < pool->n; i++)
+    SDL_SemPost(pool->w[i].go);
+  for (i = 1; i < pool->n; i++) {
+    SDL_WaitThread(pool->w[i].thread, NULL);
+    SDL_DestroySemaphore(pool->w[i].go);
+  }
+  SDL_DestroySemaphore(pool->done);
+  free(pool->w);
+  bzero(pool, sizeof(*pool));
+}
+
+/* Call func(arg, from, to) on slices covering [0, len), in parallel. */
+void workers_run(workers_t *pool, workers_func_t func, void *arg, int len,
+                 int align) {
+  int i;
+  int from, to;
+
+  if ((pool->n < 2) || (len < (pool->n * WORKERS_MIN_SLICE))) {
+    func(arg, 0, len);
+    return;
+  }
+
+  pool->func = func;
+  pool->arg = arg;
+  pool->len = len;
+  pool->align = max(1, align);
+
+  for (i = 1; i < pool->n; i++)
+    SDL_SemPost(pool->w[i].go);
+
+  workers_slice(pool, 0, &from, &to);
+  if (to > from)
+    func(arg, from, to);
+
+  for (i = 1; i < pool->n; i++)
+    SDL_SemWait(pool->done);
+}